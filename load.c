@@ -0,0 +1,375 @@
+/* load.c - load many configuration files at once.
+ *
+ * toml_load keeps up to depth files being read at once, so that a
+ * directory of configurations on a cold cache keeps the device queue
+ * full, instead of being read one file at a time. Each file is read
+ * into its own slot of the caller's buffer, and parsed as soon as it
+ * has been read.
+ *
+ * The reads go through io_uring where the kernel has it, with the slots
+ * registered as fixed buffers, and the parses are done on the calling
+ * thread. Elsewhere, or with TOML_NO_URING set in the environment,
+ * depth threads each read and parse files in turn.
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+/* io_uring is used where the kernel headers describe it; elsewhere the
+   files are read by the threads. */
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+#include "toml.h"
+
+enum { MAXDEPTH = 256 };
+
+/* Opens the file f, to read it into a slot of size bytes. Returns its
+   descriptor and sets *len to its size, or sets the error of f and
+   returns -1. */
+static int open_file(struct toml_file *f, size_t size, size_t *len) {
+  struct stat st;
+  int fd = open(f->path, O_RDONLY | O_CLOEXEC);
+
+  if (fd < 0) {
+    f->error = errno;
+    return -1;
+  }
+  if (fstat(fd, &st) != 0)
+    f->error = errno;
+  else if ((size_t) st.st_size > size)
+    f->error = EFBIG;
+  else {
+    f->error = 0;
+    *len = st.st_size;
+    return fd;
+  }
+  close(fd);
+  return -1;
+}
+
+/* Parses the len bytes of f read into slot. A document that does not
+   parse is not an exit, as in toml_unmarshal, but the error EINVAL of
+   f. Returns -1 then. */
+static int parse_file(struct toml_file *f, const char *slot, size_t len) {
+  struct toml_feed feed;
+
+  toml_feed_start(&feed, slot, f->keys, NULL);
+  if (toml_feed_end(&feed, len) != 0) {
+    f->error = EINVAL;
+    return -1;
+  }
+  return 0;
+}
+
+/* The files being loaded by threads, each into its own slot. */
+struct pool {
+  struct toml_file *files;
+  int n;
+  int next; /* the next file to load */
+  size_t slotsize;
+  int failed;
+};
+
+/* Reads and parses the file f into slot. Returns -1 if it could not be
+   read or parsed. */
+static int load_file(struct toml_file *f, char *slot, size_t size) {
+  size_t len, done = 0;
+  int fd = open_file(f, size, &len);
+
+  if (fd < 0)
+    return -1;
+  while (done < len) {
+    ssize_t n = read(fd, slot + done, len - done);
+
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0) {
+      f->error = errno;
+      close(fd);
+      return -1;
+    }
+    if (n == 0) /* it shrank */
+      len = done;
+    done += n;
+  }
+  close(fd);
+  return parse_file(f, slot, len);
+}
+
+/* The state of a thread of the pool: the pool, and its slot. */
+struct worker {
+  struct pool *pool;
+  char *slot;
+};
+
+/* Loads files into the slot of the worker until there are none left. */
+static void *work(void *arg) {
+  struct worker *w = arg;
+  struct pool *p = w->pool;
+  int i;
+
+  while ((i = __atomic_fetch_add(&p->next, 1, __ATOMIC_RELAXED)) < p->n) {
+    if (load_file(&p->files[i], w->slot, p->slotsize) != 0)
+      __atomic_store_n(&p->failed, 1, __ATOMIC_RELAXED);
+  }
+  return NULL;
+}
+
+/* Loads the files with depth threads, the calling one included. */
+static int load_threads(struct toml_file *files, int n, char *buf,
+                        size_t slotsize, int depth) {
+  struct pool p = {files, n, 0, slotsize, 0};
+  struct worker workers[MAXDEPTH];
+  pthread_t threads[MAXDEPTH];
+  int nthreads = 0;
+
+  for (int i = 0; i < depth; i++)
+    workers[i] = (struct worker){&p, buf + i * slotsize};
+  for (int i = 1; i < depth && i < n; i++) {
+    if (pthread_create(&threads[nthreads], NULL, work, &workers[i]) != 0)
+      break; /* the others will do */
+    nthreads++;
+  }
+  work(&workers[0]);
+  for (int i = 0; i < nthreads; i++)
+    pthread_join(threads[i], NULL);
+  return p.failed ? -1 : 0;
+}
+
+#ifdef HAVE_IO_URING
+/* An io_uring, mapped. */
+struct ring {
+  int fd;
+  unsigned *sqtail, *sqmask, *sqarray;
+  struct io_uring_sqe *sqes;
+  unsigned *cqhead, *cqtail, *cqmask;
+  struct io_uring_cqe *cqes;
+  void *sq, *cq;
+  size_t sqsize, cqsize, sqessize;
+};
+
+/* Sets up r with room for entries reads. */
+static int ring_setup(struct ring *r, unsigned entries) {
+  struct io_uring_params p;
+
+  memset(&p, 0, sizeof(p));
+  r->fd = syscall(__NR_io_uring_setup, entries, &p);
+  if (r->fd < 0)
+    return -1;
+  r->sqsize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cqsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  r->sqessize = p.sq_entries * sizeof(struct io_uring_sqe);
+  r->sq = mmap(NULL, r->sqsize, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  r->cq = mmap(NULL, r->cqsize, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+  r->sqes = mmap(NULL, r->sqessize, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  if (r->sq == MAP_FAILED || r->cq == MAP_FAILED || r->sqes == MAP_FAILED) {
+    if (r->sq != MAP_FAILED)
+      munmap(r->sq, r->sqsize);
+    if (r->cq != MAP_FAILED)
+      munmap(r->cq, r->cqsize);
+    if (r->sqes != MAP_FAILED)
+      munmap(r->sqes, r->sqessize);
+    close(r->fd);
+    return -1;
+  }
+  r->sqtail = (unsigned *) ((char *) r->sq + p.sq_off.tail);
+  r->sqmask = (unsigned *) ((char *) r->sq + p.sq_off.ring_mask);
+  r->sqarray = (unsigned *) ((char *) r->sq + p.sq_off.array);
+  r->cqhead = (unsigned *) ((char *) r->cq + p.cq_off.head);
+  r->cqtail = (unsigned *) ((char *) r->cq + p.cq_off.tail);
+  r->cqmask = (unsigned *) ((char *) r->cq + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *) ((char *) r->cq + p.cq_off.cqes);
+  return 0;
+}
+
+static void ring_close(struct ring *r) {
+  munmap(r->sqes, r->sqessize);
+  munmap(r->cq, r->cqsize);
+  munmap(r->sq, r->sqsize);
+  close(r->fd);
+}
+
+/* Queues a read of the iov of slot from fd at off, of the registered
+   buffer of the slot if fixed. */
+static void ring_read(struct ring *r, int fd, const struct iovec *iov,
+                      off_t off, int slot, bool fixed) {
+  unsigned tail = *r->sqtail, i = tail & *r->sqmask;
+  struct io_uring_sqe *sqe = &r->sqes[i];
+
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->fd = fd;
+  sqe->off = off;
+  sqe->user_data = slot;
+  if (fixed) {
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->addr = (unsigned long) iov->iov_base;
+    sqe->len = iov->iov_len;
+    sqe->buf_index = slot;
+  } else {
+    sqe->opcode = IORING_OP_READV;
+    sqe->addr = (unsigned long) iov;
+    sqe->len = 1;
+  }
+  r->sqarray[i] = i;
+  __atomic_store_n(r->sqtail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* Submits the n reads queued, and waits for a completion. */
+static int ring_enter(struct ring *r, unsigned n) {
+  int err;
+
+  while ((err = syscall(__NR_io_uring_enter, r->fd, n, 1,
+                        IORING_ENTER_GETEVENTS, NULL, 0)) < 0 &&
+         (errno == EINTR || errno == EAGAIN))
+    n = 0; /* they were submitted */
+  return err < 0 ? -1 : 0;
+}
+
+/* A file being read into a slot. */
+struct slot {
+  int file; /* its index, or -1 */
+  int fd;
+  size_t len, done;
+  struct iovec iov; /* the part of the slot left to read */
+};
+
+/* Opens the next file that can be read into slot s and queues its
+   read. Returns -1 if some could not be opened. */
+static int ring_start(struct ring *r, struct slot *s, int i,
+                      struct toml_file *files, int n, int *next,
+                      char *buf, size_t slotsize, bool fixed) {
+  int err = 0;
+
+  s->file = -1;
+  while (*next < n) {
+    struct toml_file *f = &files[(*next)++];
+
+    if ((s->fd = open_file(f, slotsize, &s->len)) < 0) {
+      err = -1;
+      continue;
+    }
+    s->file = f - files;
+    s->done = 0;
+    s->iov.iov_base = buf + i * slotsize;
+    s->iov.iov_len = s->len;
+    ring_read(r, s->fd, &s->iov, 0, i, fixed);
+    break;
+  }
+  return err;
+}
+
+/* Loads the files through the io_uring r, parsing each on the calling
+   thread as its read completes. */
+static int load_ring(struct ring *r, struct toml_file *files, int n,
+                     char *buf, size_t slotsize, int depth) {
+  struct slot slots[MAXDEPTH];
+  struct iovec iovs[MAXDEPTH];
+  int next = 0, inflight = 0, err = 0;
+  unsigned queued = 0;
+  bool fixed;
+
+  for (int i = 0; i < depth; i++) {
+    iovs[i].iov_base = buf + i * slotsize;
+    iovs[i].iov_len = slotsize;
+  }
+  /* registering may fail against RLIMIT_MEMLOCK: then copy, as readv */
+  fixed = syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS,
+                  iovs, depth) == 0;
+  for (int i = 0; i < depth; i++) {
+    if (ring_start(r, &slots[i], i, files, n, &next, buf, slotsize, fixed))
+      err = -1;
+    if (slots[i].file >= 0)
+      inflight++, queued++;
+  }
+  while (inflight > 0) {
+    unsigned head, tail;
+
+    if (ring_enter(r, queued) != 0)
+      break;
+    queued = 0;
+    head = *r->cqhead;
+    tail = __atomic_load_n(r->cqtail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+      struct io_uring_cqe cqe = r->cqes[head & *r->cqmask];
+      struct slot *s = &slots[cqe.user_data];
+      struct toml_file *f = &files[s->file];
+
+      __atomic_store_n(r->cqhead, head + 1, __ATOMIC_RELEASE);
+      if (cqe.res < 0) {
+        f->error = -cqe.res;
+        err = -1;
+      } else {
+        if (cqe.res == 0) /* it shrank */
+          s->len = s->done;
+        s->done += cqe.res;
+        if (s->done < s->len) { /* a short read: read the rest */
+          s->iov.iov_base = (char *) s->iov.iov_base + cqe.res;
+          s->iov.iov_len -= cqe.res;
+          ring_read(r, s->fd, &s->iov, s->done, cqe.user_data, fixed);
+          queued++;
+          continue;
+        }
+        if (parse_file(f, buf + cqe.user_data * slotsize, s->len) != 0)
+          err = -1;
+      }
+      close(s->fd);
+      inflight--;
+      if (ring_start(r, s, cqe.user_data, files, n, &next, buf, slotsize,
+                     fixed))
+        err = -1;
+      if (s->file >= 0)
+        inflight++, queued++;
+    }
+  }
+  for (int i = 0, e = errno; inflight > 0 && i < depth; i++) {
+    if (slots[i].file >= 0) { /* io_uring_enter failed */
+      files[slots[i].file].error = e;
+      close(slots[i].fd);
+      err = -1;
+    }
+  }
+  return err;
+}
+#endif
+
+int toml_load(struct toml_file *files, int n, char *buf, size_t size,
+              int depth) {
+  size_t slotsize;
+
+  if (depth > MAXDEPTH)
+    depth = MAXDEPTH;
+  if (depth > n)
+    depth = n;
+  if (depth < 1)
+    return 0;
+  slotsize = size / depth;
+#ifdef HAVE_IO_URING
+  if (getenv("TOML_NO_URING") == NULL) {
+    struct ring r;
+
+    if (ring_setup(&r, depth) == 0) {
+      int err = load_ring(&r, files, n, buf, slotsize, depth);
+
+      ring_close(&r);
+      return err;
+    }
+  }
+#endif
+  return load_threads(files, n, buf, slotsize, depth);
+}
@@ -0,0 +1,224 @@
+/* shm.c - share parsed configurations between processes.
+ *
+ * A process parses a TOML document once and publishes the values in a
+ * POSIX shared memory segment, as an image of the storage the template
+ * refers to. Other processes map the segment read-only and read the
+ * image in place. The image is relocatable: the pointers into it, of
+ * string and variant arrays, views and data, are stored as offsets from
+ * the start of the image, so the segment may be mapped at any address.
+ *
+ * Readers are never blocked. The segment carries a generation counter
+ * that is odd while an image is being written: a reader notes it
+ * before reading and reads again if it changed meanwhile.
+ *
+ * Copyright (c) 2022, Francisco Oliveto <franciscoliveto@gmail.com>
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "toml.h"
+
+#define MAGIC 0x746f6d6cUL /* "toml" */
+
+/* The start of a segment. The image follows at IMAGE bytes. */
+struct header {
+  unsigned long magic;
+  unsigned long generation;
+  size_t size;
+};
+
+enum { IMAGE = 64 };
+
+/* Maps the segment of the size bytes of an image. */
+static int map(struct toml_shm *s, int fd, int prot) {
+  void *p = mmap(NULL, IMAGE + s->size, prot, MAP_SHARED, fd, 0);
+
+  close(fd);
+  if (p == MAP_FAILED)
+    return -1;
+  s->map = p;
+  s->image = (char *) p + IMAGE;
+  return 0;
+}
+
+int toml_shm_create(struct toml_shm *s, const char *name) {
+  int fd = shm_open(name, O_RDWR | O_CREAT, 0644);
+  struct header *h;
+
+  if (fd == -1)
+    return -1;
+  if (ftruncate(fd, IMAGE + s->size) == -1) {
+    close(fd);
+    return -1;
+  }
+  if (map(s, fd, PROT_READ | PROT_WRITE) == -1)
+    return -1;
+  h = s->map;
+  h->size = s->size;
+  __atomic_store_n(&h->magic, MAGIC, __ATOMIC_RELEASE);
+  return 0;
+}
+
+int toml_shm_open(struct toml_shm *s, const char *name) {
+  int fd = shm_open(name, O_RDONLY, 0);
+  const struct header *h;
+
+  if (fd == -1)
+    return -1;
+  if (map(s, fd, PROT_READ) == -1)
+    return -1;
+  h = s->map;
+  if (__atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) != MAGIC ||
+      h->size != s->size) {
+    toml_shm_close(s);
+    return -1;
+  }
+  return 0;
+}
+
+/* Tells whether p points into the storage the image is a copy of. */
+static bool in_buf(const struct toml_shm *s, const void *p) {
+  const char *base = s->buf;
+
+  return (const char *) p >= base && (const char *) p < base + s->size;
+}
+
+/* Stores the pointer at p in the storage as an offset from its start at
+   the same place in the image, if both are in the storage. */
+static void make_offset(const struct toml_shm *s, const void *p) {
+  char *base = s->buf;
+  const char *q;
+  uintptr_t off;
+
+  if (!in_buf(s, p))
+    return;
+  memcpy(&q, p, sizeof(q));
+  if (!in_buf(s, q))
+    return;
+  off = q - base;
+  memcpy((char *) s->image + ((const char *) p - base), &off, sizeof(off));
+}
+
+/* Stores the pointers the keys of tab left in the storage in the image
+   as offsets: those of string and variant arrays, of views, and of
+   data. Keys of the elements of an array of tables are offsets from
+   base, if it is not NULL. */
+static void make_offsets(const struct toml_shm *s, const struct toml_key *tab,
+                         char *base) {
+  for (const struct toml_key *k = tab; k->name != NULL; k++) {
+    const struct toml_array *a = &k->u.array;
+    int n;
+
+    if (k->data != NULL)
+      make_offset(s, k->data);
+    if (k->type == toml_table_t)
+      make_offsets(s, k->u.table, base);
+    if (k->type == toml_strview_t) {
+      struct toml_strview *v =
+          base != NULL ? (struct toml_strview *) (base + k->u.offset)
+                       : k->u.strview.view;
+
+      if (v != NULL)
+        make_offset(s, &v->ptr);
+    }
+    if (k->type != toml_array_t || a->count == NULL)
+      continue;
+    n = (size_t) *a->count < a->len ? *a->count : (int) a->len;
+    for (int i = 0; i < n; i++) {
+      if (a->type == toml_string_t)
+        make_offset(s, &a->u.strings.ptrs[i]);
+      else if (a->type == toml_variant_t &&
+               a->u.variants.elems[i].type == toml_string_t)
+        make_offset(s, &a->u.variants.elems[i].u.string);
+      else if (a->type == toml_table_t)
+        make_offsets(s, a->u.tables.subtype,
+                     a->u.tables.base + i * a->u.tables.structsize);
+    }
+  }
+}
+
+/* Tells whether the values of the keys of tab stay in the storage: no
+   key has an allocator to grow to, and the strings of the string and
+   variant arrays and of the views in it are stored in it. */
+static bool shareable(const struct toml_shm *s, const struct toml_key *tab,
+                      char *base) {
+  for (const struct toml_key *k = tab; k->name != NULL; k++) {
+    const struct toml_array *a = &k->u.array;
+
+    if (k->alloc != NULL)
+      return false;
+    switch (k->type) {
+    case toml_table_t:
+      if (!shareable(s, k->u.table, base))
+        return false;
+      break;
+    case toml_strview_t:
+      if ((base != NULL || in_buf(s, k->u.strview.view)) && k->size > 0 &&
+          !in_buf(s, k->u.strview.store))
+        return false;
+      break;
+    case toml_array_t:
+      if (a->type == toml_string_t && in_buf(s, a->u.strings.ptrs) &&
+          a->u.strings.storelen > 0 && !in_buf(s, a->u.strings.store))
+        return false;
+      if (a->type == toml_variant_t && in_buf(s, a->u.variants.elems) &&
+          a->u.variants.storelen > 0 && !in_buf(s, a->u.variants.store))
+        return false;
+      if (a->type == toml_table_t &&
+          !shareable(s, a->u.tables.subtype, a->u.tables.base))
+        return false;
+      break;
+    default:
+      break;
+    }
+  }
+  return true;
+}
+
+int toml_shm_publish(struct toml_shm *s, FILE *f) {
+  struct header *h = s->map;
+  unsigned long gen;
+  int errnum;
+
+  if (!shareable(s, s->keys, NULL)) {
+    errno = EINVAL;
+    return -1;
+  }
+  if ((errnum = toml_unmarshal(f, s->keys)) != 0)
+    return errnum;
+  gen = __atomic_load_n(&h->generation, __ATOMIC_RELAXED);
+  __atomic_store_n(&h->generation, gen + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy((char *) s->image, s->buf, s->size);
+  make_offsets(s, s->keys, NULL);
+  __atomic_store_n(&h->generation, gen + 2, __ATOMIC_RELEASE);
+  return 0;
+}
+
+unsigned long toml_shm_begin(const struct toml_shm *s) {
+  const struct header *h = s->map;
+  unsigned long gen;
+
+  while ((gen = __atomic_load_n(&h->generation, __ATOMIC_ACQUIRE)) & 1)
+    ; /* an image is being written */
+  return gen;
+}
+
+bool toml_shm_retry(const struct toml_shm *s, unsigned long gen) {
+  const struct header *h = s->map;
+
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(&h->generation, __ATOMIC_RELAXED) != gen;
+}
+
+void toml_shm_close(struct toml_shm *s) {
+  munmap(s->map, IMAGE + s->size);
+  s->map = NULL;
+  s->image = NULL;
+}
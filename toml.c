@@ -7,27 +7,36 @@
  * When the parse succeeds, key values will be extracted into static
  * locations specified in the template structures.
  *
- * The dialect it parses has some limitations. First, only ASCII encoded
- * files are considered to be valid TOML documents. Second, all elements
- * of an array must be of the same type. Third, arrays may not be array
- * elements.
+ * Arrays may be nested. An array of one type is a matrix: the elements of
+ * its nested arrays are stored flat, the length of each dimension goes to
+ * the shape of its template, which limits how deep they nest, and all its
+ * innermost arrays must be nested to the same depth. An array of variants
+ * takes elements of any type, and stores a variant for a nested array
+ * before the variants of its elements.
+ *
+ * Documents must be UTF-8 encoded; strings and comments are validated as
+ * they are scanned.
  *
  * Copyright (c) 2022, Francisco Oliveto <franciscoliveto@gmail.com>
  * SPDX-License-Identifier: BSD-2-Clause
  */
 #include "toml.h"
 
-#include <ctype.h>
 #include <errno.h>
 #include <limits.h>
 #include <math.h> /* HUGE_VAL */
+#include <pthread.h>
+#include <sched.h>
+#include <setjmp.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-
-/* TODO: UTF-8 support. */
+#include <time.h>
+#include <unistd.h>
 
 enum {
   LBRACKETS,   /* [[ */
@@ -42,45 +51,405 @@ enum {
   FLOAT,
 };
 
-const struct toml_key *curtab, *cursor;
-static FILE *inputfp;
-struct {
+/* The parser state is thread-local, so that the sections of a document
+   can be parsed concurrently (see toml_unmarshal_parallel). */
+static _Thread_local const struct toml_key *roottab, *curtab, *cursor;
+static _Thread_local const struct toml_key *keytab; /* the table of cursor */
+static _Thread_local struct toml_template *compiled; /* see mark */
+static _Thread_local char *curbase; /* base of the current table in an array */
+static _Thread_local char *rootbase; /* base of the root table, see toml_unmarshal_base */
+static _Thread_local FILE *inputfp;
+static _Thread_local const unsigned char *inp, *inend; /* the unread input */
+static _Thread_local const char *inbuf; /* the start of all of it */
+
+enum {
+  READSIZE = 1 << 16, /* the size of a pipe, so that one read drains it */
+};
+
+/* Streams are read a block at a time into a window, from which they
+   are scanned as input in memory is: inp and inend are the unread part
+   of the window. The byte before inp is kept at refills, for
+   lex_ungetc. */
+static _Thread_local struct {
+  FILE *fp;              /* the stream, or */
+  int fd;                /* the file descriptor, if fp is NULL */
+  unsigned char *window; /* READSIZE + 1 bytes, or NULL */
+  long offset;           /* of window[0] in the stream */
+  bool eof, failed;
+} reader;
+static _Thread_local unsigned char readwindow[READSIZE + 1]; /* of streams */
+static _Thread_local const struct toml_tape *tape; /* tokens being unmarshaled */
+static _Thread_local size_t tapepos;
+static _Thread_local struct section *section; /* see table_count */
+static _Thread_local jmp_buf *errjmp;          /* see fail */
+static _Thread_local bool copyviews; /* see toml_unmarshal_incremental */
+
+/* While reloading, values are stored in a shadow copy of the storage
+   the template refers to: addresses in [lo, hi) are moved by delta. */
+static _Thread_local struct {
+  char *lo, *hi;
+  ptrdiff_t delta;
+} reloc;
+static _Thread_local struct {
   int type;
   char lexeme[BUFSIZ];
+  char *text; /* the lexeme of the current token */
+  size_t len; /* length of text, not counting the terminating '\0' */
   int pos;    /* position of the error, starting at 0 */
   int lineno; /* line number, starting at 1 */
 } token;
 
-#ifdef DEBUG_ENABLE
-#include <stdarg.h>
-void print(const char *fmt, ...) {
-  char buf[BUFSIZ];
-  va_list ap;
-  va_start(ap, fmt);
-  vsnprintf(buf, sizeof(buf), fmt, ap);
-  va_end(ap);
-  fputs(buf, stderr);
+/* Lexemes are normally stored in token.lexeme, but the parser may
+   direct the next string to the storage of its value (see lex_sink),
+   so that strings of any length are stored in place rather than being
+   staged in token.lexeme and copied. */
+static _Thread_local struct {
+  char *buf;
+  size_t size;
+  bool strict; /* a string that does not fit is an error, not truncated */
+  bool view;   /* the string may be left in the input, see lex_view */
+  const struct toml_allocator *alloc; /* see lex_grow */
+} sink;
+
+static _Thread_local char *lexp;   /* where the next byte of the lexeme goes */
+static _Thread_local char *lexend; /* the last byte, reserved for '\0' */
+static _Thread_local bool lexstrict;
+static _Thread_local bool lexview; /* the lexeme is the input at token.text */
+static _Thread_local bool lexgrown; /* the lexeme outgrew the sink */
+
+/* Returns how far the input has been read, or -1 if that is not known. */
+static long input_position(void) {
+  if (reader.window != NULL)
+    return reader.offset + (inp - reader.window);
+  if (inp != NULL)
+    return (const char *) inp - inbuf;
+  return -1;
 }
 
-#define log_print(...) print(__VA_ARGS__)
-#else
-#define log_print(...) \
-  do {                 \
+/* The ring the parses of the thread trace their events into. */
+static _Thread_local struct toml_trace *tracering;
+
+/* Records the event, and the key named name, if any, in tracering. */
+static void trace_event(int event, const char *name) {
+  struct toml_trace *t = tracering;
+  unsigned long i = __atomic_fetch_add(&t->count, 1, __ATOMIC_RELAXED);
+  struct toml_trace_record *r = &t->records[i & (t->len - 1)];
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  r->time = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  r->lineno = token.lineno;
+  r->offset = (unsigned) input_position();
+  r->event = event;
+  if (name != NULL)
+    strncpy(r->key, name, sizeof(r->key));
+  else
+    r->key[0] = '\0';
+}
+
+/* Traces the event if the thread has a ring to trace into. */
+#define trace(event, name)          \
+  do {                              \
+    if (tracering != NULL)          \
+      trace_event((event), (name)); \
   } while (0)
+
+/* The USDT probes of the provider toml, which are nops until bpftrace
+   or SystemTap attach to them:
+
+     parse__start(lineno)       a parse, or a section, starts
+     parse__done(lineno)        and ends without error
+     table(name, lineno)        a [ table ] or [[ array ]] header
+     key(name, lineno)          a key is looked up
+     error(status, lineno)      the parse fails
+
+   There are none without <sys/sdt.h>, or with TOML_NO_PROBES. */
+#if !defined(TOML_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define probe1(name, a) DTRACE_PROBE1(toml, name, a)
+#define probe2(name, a, b) DTRACE_PROBE2(toml, name, a, b)
+#endif
+#endif
+#ifndef probe1
+#define probe1(name, a) ((void) 0)
+#define probe2(name, a, b) ((void) 0)
+#endif
+
+/* The statistics of the process, see toml_stats_get, and those of the
+   thread not yet added to them. */
+static struct toml_stats stats;
+static pthread_mutex_t statslock = PTHREAD_MUTEX_INITIALIZER;
+static _Thread_local struct toml_stats tstats;
+
+/* Raises the high-water mark *max to n. */
+static void high_water(size_t *max, size_t n) {
+  if (n > *max)
+    *max = n;
+}
+
+/* Adds the statistics of the thread to those of the process. */
+static void stats_flush(void) {
+  pthread_mutex_lock(&statslock);
+  stats.bytes += tstats.bytes;
+  stats.tokens += tstats.tokens;
+  stats.lookups += tstats.lookups;
+  stats.probes += tstats.probes;
+  stats.strings += tstats.strings;
+  stats.stringbytes += tstats.stringbytes;
+  high_water(&stats.max_store, tstats.max_store);
+  high_water(&stats.max_elements, tstats.max_elements);
+  high_water(&stats.max_lexeme, tstats.max_lexeme);
+  for (int i = 0; i < TOML_NPHASES; i++) {
+    stats.phases[i].cycles += tstats.phases[i].cycles;
+    stats.phases[i].instructions += tstats.phases[i].instructions;
+    stats.phases[i].branch_misses += tstats.phases[i].branch_misses;
+    stats.phases[i].cache_misses += tstats.phases[i].cache_misses;
+  }
+  pthread_mutex_unlock(&statslock);
+  memset(&tstats, 0, sizeof(tstats));
+}
+
+#ifdef TOML_PROFILE
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+enum { NCOUNTERS = sizeof(struct toml_counters) / sizeof(unsigned long long) };
+
+/* The counters of a thread are a perf_event_open group, read at once
+   through its leader. counter[i] is the index in struct toml_counters
+   of its ith member. */
+static _Thread_local struct {
+  bool opened;
+  int leader;
+  int n;
+  int counter[NCOUNTERS];
+  enum toml_phase phase;     /* the phase being counted */
+  enum toml_phase outer[8]; /* the phases it interrupted */
+  int depth;
+  unsigned long long last[NCOUNTERS]; /* the counts when it started */
+} prof = {.leader = -1};
+
+static pthread_key_t profkey;
+static pthread_once_t profonce = PTHREAD_ONCE_INIT;
+
+/* Closes the counters of a thread that exits. */
+static void profile_close(void *arg) {
+  (void) arg;
+  stats_flush();
+#ifdef __linux__
+  if (prof.leader >= 0)
+    close(prof.leader); /* the other members go with it */
+#endif
+}
+
+static void profile_key(void) { pthread_key_create(&profkey, profile_close); }
+
+/* Opens the counters of the thread, those that the kernel lets it. */
+static void profile_open(void) {
+#ifdef __linux__
+  static const unsigned long long config[NCOUNTERS] = {
+      PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+      PERF_COUNT_HW_BRANCH_MISSES, PERF_COUNT_HW_CACHE_MISSES};
+
+  for (int i = 0; i < NCOUNTERS; i++) {
+    struct perf_event_attr attr = {
+        .type = PERF_TYPE_HARDWARE,
+        .size = sizeof(attr),
+        .config = config[i],
+        .read_format = PERF_FORMAT_GROUP,
+        .exclude_kernel = 1,
+        .exclude_hv = 1,
+    };
+    int fd = syscall(SYS_perf_event_open, &attr, 0, -1, prof.leader, 0);
+
+    if (fd < 0)
+      continue;
+    if (prof.leader < 0)
+      prof.leader = fd;
+    prof.counter[prof.n++] = i;
+  }
 #endif
+  pthread_once(&profonce, profile_key);
+  pthread_setspecific(profkey, &prof);
+  prof.opened = true;
+}
+
+/* Reads the counters of the thread into c. */
+static void profile_read(unsigned long long c[NCOUNTERS]) {
+  bool cycles = false;
+
+  memset(c, 0, NCOUNTERS * sizeof(c[0]));
+#ifdef __linux__
+  if (prof.leader >= 0) {
+    unsigned long long v[1 + NCOUNTERS];
+
+    if (read(prof.leader, v, sizeof(v)) > 0) {
+      for (unsigned long long i = 0; i < v[0]; i++)
+        c[prof.counter[i]] = v[1 + i];
+      cycles = prof.counter[0] == 0;
+    }
+  }
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+  if (!cycles)
+    c[0] = __builtin_ia32_rdtsc();
+#else
+  (void) cycles;
+#endif
+}
+
+/* Charges the costs since the last call to the phase being counted,
+   and starts counting phase. */
+static void profile(enum toml_phase phase) {
+  unsigned long long c[NCOUNTERS], *to;
+
+  profile_read(c);
+  to = &tstats.phases[prof.phase].cycles;
+  for (int i = 0; i < NCOUNTERS; i++)
+    to[i] += c[i] - prof.last[i];
+  memcpy(prof.last, c, sizeof(c));
+  prof.phase = phase;
+}
+
+/* Starts counting a parse, in toml_parse_phase. */
+static void profile_start(void) {
+  if (!prof.opened)
+    profile_open();
+  profile_read(prof.last);
+  prof.phase = toml_parse_phase;
+  prof.depth = 0;
+}
+
+/* Stops counting a parse. */
+static void profile_stop(void) { profile(toml_parse_phase); }
+
+/* Counts phase until the matching profile_leave. */
+static void profile_enter(enum toml_phase phase) {
+  if (prof.depth < (int) toml_len(prof.outer))
+    prof.outer[prof.depth] = prof.phase;
+  prof.depth++;
+  profile(phase);
+}
+
+static void profile_leave(void) {
+  prof.depth--;
+  profile(prof.depth < (int) toml_len(prof.outer) ? prof.outer[prof.depth]
+                                                  : toml_parse_phase);
+}
+
+#define PROFILE_START() profile_start()
+#define PROFILE_STOP() profile_stop()
+#define PROFILE_ENTER(phase) profile_enter(phase)
+#define PROFILE_LEAVE() profile_leave()
+#else
+#define PROFILE_START() ((void) 0)
+#define PROFILE_STOP() ((void) 0)
+#define PROFILE_ENTER(phase) ((void) 0)
+#define PROFILE_LEAVE() ((void) 0)
+#endif
+
+/* Abandons the parse with the given status. A reload returns it to
+   its caller, so that a bad revision is rejected without publishing
+   anything; otherwise the program exits. */
+static _Noreturn void fail(int status) {
+  probe2(error, status, token.lineno);
+  if (errjmp != NULL)
+    longjmp(*errjmp, status);
+  exit(status);
+}
 
+/* The error that abandoned the last parse that failed, see
+   toml_last_error. */
+static _Thread_local struct toml_error lasterror;
+
+/* Abandons the parse with a syntax error. Its message is kept in
+   lasterror, and written to stderr only if the program exits: a
+   status that is returned is for the caller to report. */
 void error_printf(const char *fmt, ...) {
-  char buf[BUFSIZ];
   va_list ap;
 
-  fprintf(stderr, "syntax error (line %d, column %d): ", token.lineno,
-          token.pos);
+  trace(toml_syntax_event, cursor != NULL ? cursor->name : NULL);
+  lasterror.lineno = token.lineno;
+  lasterror.column = token.pos;
   va_start(ap, fmt);
-  vsnprintf(buf, sizeof(buf), fmt, ap);
+  vsnprintf(lasterror.message, sizeof(lasterror.message), fmt, ap);
   va_end(ap);
-  fputs(buf, stderr);
-  fputc('\n', stderr);
-  exit(2);
+  if (errjmp == NULL)
+    fprintf(stderr, "syntax error (line %d, column %d): %s\n",
+            lasterror.lineno, lasterror.column, lasterror.message);
+  fail(2);
+}
+
+/* Reads the next block of the stream into the window, and returns its
+   first byte, or EOF. */
+static int refill(void) {
+  unsigned char *w = reader.window;
+  ssize_t n = 0;
+
+  w[0] = inend[-1];
+  reader.offset += (inend - w) - 1;
+  inp = inend = w + 1;
+  while (!reader.eof) {
+    if (reader.fp != NULL) {
+      n = fread(w + 1, 1, READSIZE, reader.fp);
+      reader.failed = n == 0 && ferror(reader.fp);
+    } else if ((n = read(reader.fd, w + 1, READSIZE)) < 0 && errno == EINTR)
+      continue;
+    else
+      reader.failed = n < 0;
+    reader.eof = n <= 0;
+    break;
+  }
+  if (n <= 0)
+    return EOF;
+  inend = w + 1 + n;
+  return *inp++;
+}
+
+/* Starts reading the stream fp, or fd if fp is NULL, into window. */
+static void read_stream(FILE *fp, int fd, unsigned char *window) {
+  inputfp = fp;
+  reader.fp = fp;
+  reader.fd = fd;
+  reader.window = window;
+  reader.offset = -1;
+  reader.eof = reader.failed = false;
+  inp = inend = window + 1;
+}
+
+/* Starts reading the len bytes at buf. */
+static void read_memory(const char *buf, size_t len) {
+  inputfp = NULL;
+  reader.window = NULL;
+  inp = (const unsigned char *) buf;
+  inend = inp + len;
+  inbuf = buf;
+}
+
+/* Stops reading the input. */
+static void read_done(void) {
+  reader.window = NULL;
+  inp = inend = NULL;
+}
+
+/* Returns the next character of the input, refilling the window of a
+   stream when it runs out. */
+static int lex_getc(FILE *fp) {
+  (void) fp;
+  if (inp < inend)
+    return *inp++;
+  return reader.window != NULL ? refill() : EOF;
+}
+
+/* Pushes the character c back onto the input. */
+static void lex_ungetc(int c, FILE *fp) {
+  (void) fp;
+  if (c != EOF)
+    inp--;
 }
 
 /* Checks for and consume \r, \n, \r\n, or EOF */
@@ -89,116 +458,532 @@ static bool endofline(int c, FILE *fp) {
 
   eol = (c == '\r' || c == '\n');
   if (c == '\r') {
-    c = getc(fp);
+    c = lex_getc(fp);
     if (c != '\n' && c != EOF)
-      ungetc(c, fp); /* read to far, put it back */
+      lex_ungetc(c, fp); /* read to far, put it back */
   }
   return eol;
 }
 
+/* lex_sink directs the next string token to the size bytes at buf. A
+   NULL buf restores the default, token.lexeme. */
+static void lex_sink(char *buf, size_t size, bool strict) {
+  sink.buf = size > 0 ? buf : NULL;
+  sink.size = size;
+  sink.strict = strict;
+  sink.view = false;
+  sink.alloc = NULL;
+}
+
+/* lex_view is like lex_sink, but when the input is in memory the next
+   string is left where it is, and only goes to buf if it has escapes.
+   Such a lexeme is not '\0'-terminated. */
+static void lex_view(char *buf, size_t size) {
+  lex_sink(buf, size, false);
+  sink.view = true;
+}
+
+/* Starts a new lexeme. Only strings go to the sink. */
+static void lex_begin(bool string) {
+  lexgrown = false;
+  lexview = string && sink.view && inp != NULL && reader.window == NULL;
+  if (lexview) { /* the bytes are counted, not copied */
+    token.text = (char *) inp;
+    lexend = (char *) inend;
+    lexstrict = false;
+  } else if (string && sink.buf != NULL) {
+    token.text = sink.buf;
+    lexend = sink.buf + sink.size - 1;
+    lexstrict = sink.strict;
+  } else {
+    token.text = token.lexeme;
+    lexend = token.lexeme + sizeof(token.lexeme) - 1;
+    lexstrict = true;
+  }
+  lexp = token.text;
+}
+
+/* Handles a lexeme that does not fit in its storage. */
+static void lex_overflow(void) {
+  if (lexstrict) {
+    if (token.text == token.lexeme)
+      error_printf("token too long");
+    error_printf("ran out of storage for string");
+  }
+  lexend = lexp; /* truncate, dropping the rest of the lexeme */
+}
+
+/* Returns size bytes from the allocator a, or fails. */
+static void *allocate(const struct toml_allocator *a, size_t size) {
+  void *p = a->alloc(a->ctx, size);
+
+  if (p == NULL)
+    error_printf("out of memory");
+  return p;
+}
+
+/* Moves a lexeme that does not fit in the sink to storage from the
+   allocator of the sink, if it has one, with room for n more bytes.
+   The storage is at least doubled each time. */
+static bool lex_grow(size_t n) {
+  const struct toml_allocator *a = sink.alloc;
+  size_t used = lexp - token.text, size = 2 * (lexend + 1 - token.text);
+  char *p;
+
+  if (a == NULL || lexview || token.text == token.lexeme)
+    return false;
+  if (size < used + n + 1)
+    size = used + n + 1;
+  p = allocate(a, size);
+  memcpy(p, token.text, used);
+  if (lexgrown && a->free != NULL)
+    a->free(a->ctx, token.text, lexend + 1 - token.text);
+  token.text = p;
+  lexp = p + used;
+  lexend = p + size - 1;
+  lexgrown = true;
+  return true;
+}
+
+/* Appends the character c to the lexeme. */
+static void lex_putc(int c) {
+  if (lexp < lexend || lex_grow(1)) {
+    if (!lexview)
+      *lexp = c;
+    lexp++;
+  } else
+    lex_overflow();
+}
+
+/* Appends the n bytes at s to the lexeme. A UTF-8 sequence is either
+   stored whole or not at all. */
+static void lex_put(const char *s, int n) {
+  if (lexend - lexp >= n || lex_grow(n)) {
+    if (!lexview)
+      memcpy(lexp, s, n);
+    lexp += n;
+  } else
+    lex_overflow();
+}
+
+/* Appends the n bytes of valid UTF-8 at s to the lexeme, or as many
+   whole sequences as fit. */
+static void lex_putrun(const char *s, size_t n) {
+  if ((size_t) (lexend - lexp) < n && !lex_grow(n)) {
+    n = lexend - lexp;
+    while (n > 0 && (s[n] & 0xc0) == 0x80) /* keep sequences whole */
+      n--;
+    if (!lexview)
+      memcpy(lexp, s, n);
+    lexp += n;
+    lex_overflow();
+    return;
+  }
+  if (!lexview)
+    memcpy(lexp, s, n);
+  lexp += n;
+}
+
+enum {
+  RUNSIZE = 1 << 12, /* the most input lex_run looks at once */
+};
+
+/* Returns the number of continuation bytes of the UTF-8 sequence that
+   starts with the byte c, and sets lo and hi to the range of the first
+   of them, or returns -1 if c cannot start one. Overlong forms,
+   surrogates and code points above U+10FFFF are ruled out, as RFC 3629
+   requires. */
+static int utf8_lead(int c, int *lo, int *hi) {
+  *lo = 0x80, *hi = 0xbf;
+  if (c >= 0xc2 && c <= 0xdf)
+    return 1;
+  if (c >= 0xe0 && c <= 0xef) {
+    if (c == 0xe0)
+      *lo = 0xa0; /* overlong */
+    else if (c == 0xed)
+      *hi = 0x9f; /* surrogates */
+    return 2;
+  }
+  if (c >= 0xf0 && c <= 0xf4) {
+    if (c == 0xf0)
+      *lo = 0x90; /* overlong */
+    else if (c == 0xf4)
+      *hi = 0x8f; /* above U+10FFFF */
+    return 3;
+  }
+  return -1;
+}
+
+/* Appends the run of characters at inp, up to the first of the
+   characters stops, to the lexeme in one copy, and consumes it. Each
+   stop is searched for with memchr up to the nearest found before it,
+   so the closing quote goes first. ASCII is skipped a word at a time,
+   and UTF-8 sequences are validated in place. The run ends before a
+   sequence that is not valid, or not whole in the input read so far,
+   which the caller's lex_getc and lex_utf8 take over. */
+static void lex_run(const char *stops) {
+  const unsigned char *end = inend, *p;
+
+  if (inp == NULL)
+    return;
+  if (end - inp > RUNSIZE)
+    end = inp + RUNSIZE;
+  for (; *stops != '\0' && end > inp; stops++) {
+    const unsigned char *q = memchr(inp, *stops, end - inp);
+
+    if (q != NULL)
+      end = q;
+  }
+  for (p = inp; p < end;) {
+    uint64_t w;
+    int n, lo, hi, i;
+
+    if (end - p >= 8) {
+      memcpy(&w, p, 8);
+      if ((w & 0x8080808080808080u) == 0) {
+        p += 8;
+        continue;
+      }
+    }
+    if (*p < 0x80) {
+      p++;
+      continue;
+    }
+    if ((n = utf8_lead(*p, &lo, &hi)) < 0 || end - p <= n)
+      break;
+    for (i = 1; i <= n && p[i] >= lo && p[i] <= hi; i++)
+      lo = 0x80, hi = 0xbf;
+    if (i <= n)
+      break;
+    p += n + 1;
+  }
+  if (p > inp) {
+    lex_putrun((const char *) inp, p - inp);
+    inp = p;
+  }
+}
+
+/* Copies a lexeme left in the input to where it would have gone, as
+   what follows in the string, an escape, is not as in the input. */
+static void lex_unview(void) {
+  const char *from = token.text;
+  size_t n = lexp - token.text;
+
+  if (!lexview)
+    return;
+  sink.view = false;
+  lex_begin(true);
+  if (n > (size_t) (lexend - lexp) && !lex_grow(n)) {
+    n = lexend - lexp;
+    while (n > 0 && (from[n] & 0xc0) == 0x80) /* keep sequences whole */
+      n--;
+    memcpy(lexp, from, n);
+    lexp += n;
+    lex_overflow();
+  } else {
+    memcpy(lexp, from, n);
+    lexp += n;
+  }
+}
+
+/* Terminates the lexeme and records its length. */
+static void lex_end(void) {
+  if (!lexview)
+    *lexp = '\0';
+  token.len = lexp - token.text;
+}
+
 /* Returns but does not consume the next character in the input. */
 static int lex_peek(FILE *fp) {
   int c;
-  c = getc(fp);
-  ungetc(c, fp);
+  c = lex_getc(fp);
+  lex_ungetc(c, fp);
   return c;
 }
 
+/* Classes of the characters of the TOML grammar, see inclass. */
+enum {
+  C_SPACE = 1,   /* ' ' and '\t', not the other isspace characters */
+  C_NEWLINE = 2, /* '\n' and '\r' */
+  C_DIGIT = 4,
+  C_HEX = 8,     /* hexadecimal digits */
+  C_ALPHA = 16,  /* ASCII letters, whatever the locale */
+  C_BARE = 32,   /* characters of bare keys */
+};
+
+#define D (C_DIGIT | C_HEX | C_BARE)
+#define X (C_ALPHA | C_HEX | C_BARE)
+#define A (C_ALPHA | C_BARE)
+static const unsigned char cclass[256] = {
+    [' '] = C_SPACE,
+    ['\t'] = C_SPACE,
+    ['\n'] = C_NEWLINE,
+    ['\r'] = C_NEWLINE,
+    ['0'] = D, ['1'] = D, ['2'] = D, ['3'] = D, ['4'] = D, ['5'] = D,
+    ['6'] = D, ['7'] = D, ['8'] = D, ['9'] = D,
+    ['a'] = X, ['b'] = X, ['c'] = X, ['d'] = X, ['e'] = X, ['f'] = X,
+    ['A'] = X, ['B'] = X, ['C'] = X, ['D'] = X, ['E'] = X, ['F'] = X,
+    ['g'] = A, ['h'] = A, ['i'] = A, ['j'] = A, ['k'] = A, ['l'] = A,
+    ['m'] = A, ['n'] = A, ['o'] = A, ['p'] = A, ['q'] = A, ['r'] = A,
+    ['s'] = A, ['t'] = A, ['u'] = A, ['v'] = A, ['w'] = A, ['x'] = A,
+    ['y'] = A, ['z'] = A,
+    ['G'] = A, ['H'] = A, ['I'] = A, ['J'] = A, ['K'] = A, ['L'] = A,
+    ['M'] = A, ['N'] = A, ['O'] = A, ['P'] = A, ['Q'] = A, ['R'] = A,
+    ['S'] = A, ['T'] = A, ['U'] = A, ['V'] = A, ['W'] = A, ['X'] = A,
+    ['Y'] = A, ['Z'] = A,
+    ['-'] = C_BARE,
+    ['_'] = C_BARE,
+};
+#undef D
+#undef X
+#undef A
+
+/* Tells if the character c, or EOF, is in one of the classes. EOF is
+   in none, as 0xff is not a character of UTF-8. */
+static inline bool inclass(int c, int classes) {
+  return (cclass[(unsigned char) c] & classes) != 0;
+}
+
 /* Scans for a number (integer, float) */
 static int lex_scan_number(int c, FILE *fp) {
   bool isfloat = false;
-  char *p = token.lexeme;
 
-  /* FIXME: validate size */
-  *p++ = c;
-  while (isdigit(c = getc(fp)) || c == '_' || c == '.') {
+  lex_begin(false);
+  lex_putc(c);
+  while (inclass(c = lex_getc(fp), C_DIGIT) || c == '_' || c == '.') {
     if (c == '.')
       isfloat = true;
     if (c != '_')
-      *p++ = c;
+      lex_putc(c);
   }
-  *p = '\0';
-  ungetc(c, fp);
+  lex_end();
+  lex_ungetc(c, fp);
   return isfloat ? FLOAT : INTEGER;
 }
 
-/* Scans for a literal string. */
-static int lex_scan_literal_string(FILE *fp) {
-  int c;
-  char *p = token.lexeme;
+/* Values of the hexadecimal digits. */
+static const unsigned char hexval[256] = {
+    ['0'] = 0,   ['1'] = 1,   ['2'] = 2,   ['3'] = 3,   ['4'] = 4,
+    ['5'] = 5,   ['6'] = 6,   ['7'] = 7,   ['8'] = 8,   ['9'] = 9,
+    ['a'] = 10,  ['b'] = 11,  ['c'] = 12,  ['d'] = 13,  ['e'] = 14,
+    ['f'] = 15,  ['A'] = 10,  ['B'] = 11,  ['C'] = 12,  ['D'] = 13,
+    ['E'] = 14,  ['F'] = 15,
+};
 
-  while ((c = getc(fp)) != '\'' && c != '\r' && c != '\n')
-    *p++ = c;
-  *p = '\0';
-  if (c == '\'')
-    return STRING;
-  if (c == '\r' || c == '\n')
-    error_printf("saw '\\n' before '\''");
-  else if (c == EOF) {
-    if (ferror(fp))
-      error_printf("input failed");
-    else
-      error_printf("saw EOF before '\''");
+/* Encodes the Unicode scalar value cp as UTF-8 into p. Returns the
+   number of bytes written. */
+static int utf8_encode(char *p, long cp) {
+  if (cp < 0x80) {
+    p[0] = (char) cp;
+    return 1;
   }
-  return -1;  // FIXME: what to return in case of error?
+  if (cp < 0x800) {
+    p[0] = (char) (0xc0 | (cp >> 6));
+    p[1] = (char) (0x80 | (cp & 0x3f));
+    return 2;
+  }
+  if (cp < 0x10000) {
+    p[0] = (char) (0xe0 | (cp >> 12));
+    p[1] = (char) (0x80 | ((cp >> 6) & 0x3f));
+    p[2] = (char) (0x80 | (cp & 0x3f));
+    return 3;
+  }
+  p[0] = (char) (0xf0 | (cp >> 18));
+  p[1] = (char) (0x80 | ((cp >> 12) & 0x3f));
+  p[2] = (char) (0x80 | ((cp >> 6) & 0x3f));
+  p[3] = (char) (0x80 | (cp & 0x3f));
+  return 4;
+}
+
+/* Consumes the continuation bytes of the UTF-8 sequence that starts
+   with the byte c, validating them in the same pass, and copies the
+   whole sequence to p. Returns the number of bytes written. */
+static int lex_utf8(int c, FILE *fp, char *p) {
+  int n, lo, hi;
+
+  if ((n = utf8_lead(c, &lo, &hi)) < 0) {
+    error_printf("invalid UTF-8 byte 0x%02x", c);
+    return -1;
+  }
+  p[0] = (char) c;
+  for (int i = 1; i <= n; i++) {
+    c = lex_getc(fp);
+    if (c < lo || c > hi)
+      error_printf("invalid UTF-8 sequence");
+    p[i] = (char) c;
+    lo = 0x80, hi = 0xbf;
+  }
+  return n + 1;
+}
+
+/* Consumes the n hexadecimal digits of a \uXXXX or \UXXXXXXXX escape
+   and returns the Unicode scalar value they denote. */
+static long lex_unicode(FILE *fp, int n) {
+  long cp = 0;
+
+  for (int i = 0; i < n; i++) {
+    int c = lex_getc(fp);
+    if (!inclass(c, C_HEX))
+      error_printf("invalid unicode escape sequence");
+    cp = (cp << 4) | hexval[c];
+  }
+  if ((cp >= 0xd800 && cp <= 0xdfff) || cp > 0x10ffff)
+    error_printf("invalid unicode scalar value U+%lX", cp);
+  return cp;
 }
 
-/* Consumes an escaped character. */
-static int lex_escape(FILE *fp) {
+/* Consumes an escaped character and writes its UTF-8 encoding to p.
+   Returns the number of bytes written. */
+static int lex_escape(FILE *fp, char *p) {
   int c;
 
-  switch (c = getc(fp)) {
+  switch (c = lex_getc(fp)) {
   case 'b':
-    return '\b';
+    *p = '\b';
+    return 1;
   case 'f':
-    return '\f';
+    *p = '\f';
+    return 1;
   case 'n':
-    return '\n';
+    *p = '\n';
+    return 1;
   case 'r':
-    return '\r';
+    *p = '\r';
+    return 1;
   case 't':
-    return '\t';
+    *p = '\t';
+    return 1;
   case '"':
   case '\\':
-    return c;
+    *p = (char) c;
+    return 1;
   case 'u': /* \uXXXX */
+    return utf8_encode(p, lex_unicode(fp, 4));
   case 'U': /* \UXXXXXXXX */
-    break;
+    return utf8_encode(p, lex_unicode(fp, 8));
+  }
+  error_printf("invalid escape sequence '\\%c'", c);
+  return -1;  // FIXME: what to return in case of error?
+}
+
+/* Scans for a literal string. */
+static int lex_scan_literal_string(FILE *fp) {
+  int c;
+  char seq[4];
+
+  lex_begin(true);
+  for (;;) {
+    lex_run("'\n\r");
+    if ((c = lex_getc(fp)) == '\'' || c == '\r' || c == '\n' || c == EOF)
+      break;
+    if (c >= 0x80)
+      lex_put(seq, lex_utf8(c, fp, seq));
+    else
+      lex_putc(c);
+  }
+  lex_end();
+  if (c == '\'')
+    return STRING;
+  if (c == '\r' || c == '\n')
+    error_printf("saw '\\n' before '\''");
+  else if (c == EOF) {
+    if (reader.failed)
+      error_printf("input failed");
+    else
+      error_printf("saw EOF before '\''");
   }
-  error_printf("invalid escape sequence '\%c'", c);
   return -1;  // FIXME: what to return in case of error?
 }
 
 /* Scans for multiline literal strings. */
 static int lex_scan_ml_literal_string(FILE *fp) {
-  (void) fp;
-  return STRING;
+  int c;
+  char seq[4];
+
+  if (endofline(c = lex_getc(fp), fp))
+    token.lineno++; /* a newline after the delimiter is trimmed */
+  else
+    lex_ungetc(c, fp); /* was not a newline, put it back */
+  lex_begin(true);
+
+  for (;;) {
+    /* as with multiline strings, up to two quotes may precede the
+       closing delimiter: '''str''''' */
+    int n;
+
+    /* copy the runs of plain characters up to the next quote */
+    for (;;) {
+      lex_run("'\n");
+      if ((c = lex_getc(fp)) == '\'' || c == EOF || c >= 0x80)
+        break;
+      if (c == '\n')
+        token.lineno++;
+      lex_putc(c);
+    }
+    for (n = 0; c == '\''; c = lex_getc(fp))
+      n++;
+    if (n == 3 || n == 4 || n == 5) {
+      lex_ungetc(c, fp);
+      for (; n > 3; n--)
+        lex_putc('\'');
+      lex_end();
+      return STRING;
+    }
+    if (c == EOF)
+      error_printf("saw EOF before '''");
+    if (n > 5)
+      error_printf(
+          "too many single quotes at the end of "
+          "multiline literal string");
+    for (int i = 0; i < n; i++)
+      lex_putc('\'');
+    if (c >= 0x80)
+      lex_put(seq, lex_utf8(c, fp, seq));
+    else {
+      if (c == '\n')
+        token.lineno++;
+      lex_putc(c);
+    }
+  }
 }
 
 /* Scans for multiline strings. */
 static int lex_scan_ml_string(FILE *fp) {
   int c;
-  char *p = token.lexeme;
+  char seq[4];
 
-  if (!endofline(c = getc(fp), fp))
-    ungetc(c, fp); /* was not a newline, put it back */
+  if (endofline(c = lex_getc(fp), fp))
+    token.lineno++; /* a newline after the delimiter is trimmed */
+  else
+    lex_ungetc(c, fp); /* was not a newline, put it back */
+  lex_begin(true);
 
-  /* FIXME: validate string size */
   for (;;) {
     /* the string can contain " and "", including at the end: """str"""""
        6 or more at the end, however, is an error. */
     int n;
-    for (n = 0; (c = getc(fp)) == '"';)
+
+    /* copy the runs of plain characters up to the next quote or
+       backslash */
+    for (;;) {
+      lex_run("\"\n\\");
+      if ((c = lex_getc(fp)) == '"' || c == '\\' || c == EOF || c >= 0x80)
+        break;
+      if (c == '\n')
+        token.lineno++;
+      lex_putc(c);
+    }
+    for (n = 0; c == '"'; c = lex_getc(fp))
       n++;
     if (n == 3 || n == 4 || n == 5) {
-      ungetc(c, fp); /* probably \r or \n */
+      lex_ungetc(c, fp); /* probably \r or \n */
       if (n == 4)    /* one double quote at the end: """" */
-        *p++ = '"';
+        lex_putc('"');
       else if (n == 5) { /* two double quotes at the end: """"" */
-        *p++ = '"';
-        *p++ = '"';
+        lex_putc('"');
+        lex_putc('"');
       }
-      *p = '\0';
+      lex_end();
       return STRING;
     }
     if (c == EOF)
@@ -208,39 +993,54 @@ static int lex_scan_ml_string(FILE *fp) {
           "too many double quotes at the end of "
           "multiline string");
     for (int i = 0; i < n; i++)
-      *p++ = '"';
+      lex_putc('"');
     if (c == '\\') {
       int peek = lex_peek(fp);
-      if (isspace(peek)) {
-        while (isspace(c = getc(fp)))
-          ;
-        ungetc(c, fp);
+
+      lex_unview();
+      if (inclass(peek, C_SPACE | C_NEWLINE)) {
+        while (inclass(c = lex_getc(fp), C_SPACE | C_NEWLINE))
+          if (c == '\n')
+            token.lineno++;
+        lex_ungetc(c, fp);
         continue;
       }
-      c = lex_escape(fp);
+      lex_put(seq, lex_escape(fp, seq));
+    } else if (c >= 0x80)
+      lex_put(seq, lex_utf8(c, fp, seq));
+    else {
+      if (c == '\n')
+        token.lineno++;
+      lex_putc(c);
     }
-    *p++ = c;
   }
 }
 
 /* Scans for a basic string. */
 static int lex_scan_string(FILE *fp) {
   int c;
-  char *p = token.lexeme;
+  char seq[4];
 
-  /* FIXME: validate string size */
-  while ((c = getc(fp)) != '"' && c != '\r' && c != '\n') {
-    if (c == '\\')
-      c = lex_escape(fp);
-    *p++ = c;
+  lex_begin(true);
+  for (;;) {
+    lex_run("\"\\\n\r");
+    if ((c = lex_getc(fp)) == '"' || c == '\r' || c == '\n' || c == EOF)
+      break;
+    if (c == '\\') {
+      lex_unview();
+      lex_put(seq, lex_escape(fp, seq));
+    } else if (c >= 0x80)
+      lex_put(seq, lex_utf8(c, fp, seq));
+    else
+      lex_putc(c);
   }
-  *p = '\0';
+  lex_end();
   if (c == '"')
     return STRING;
   if (c == '\r' || c == '\n')
     error_printf("saw '\\n' before '\"'");
   else if (c == EOF) {
-    if (ferror(fp))
+    if (reader.failed)
       error_printf("input failed");
     else
       error_printf("saw EOF before '\"'");
@@ -252,26 +1052,29 @@ static int lex_scan_string(FILE *fp) {
 static int lex_scan(FILE *fp) {
   int c;
 
-  while ((c = getc(fp)) != EOF) {
-    if (c == ' ' || c == '\t')
+  while ((c = lex_getc(fp)) != EOF) {
+    if (inclass(c, C_SPACE))
       continue;
     if (c == '#') { /* ignore comment */
-      while ((c = getc(inputfp)) != EOF && c != '\r' && c != '\n')
-        ;
-      ungetc(c, inputfp); /* put \r or \n back */
+      char seq[4];
+
+      while ((c = lex_getc(inputfp)) != EOF && c != '\r' && c != '\n')
+        if (c >= 0x80)
+          lex_utf8(c, inputfp, seq); /* comments must be valid UTF-8 too */
+      lex_ungetc(c, inputfp); /* put \r or \n back */
       continue;
     }
 
     if (c == '[') {
-      if ((c = getc(fp)) == '[')
+      if ((c = lex_getc(fp)) == '[')
         return token.type = LBRACKETS;
-      ungetc(c, fp);
+      lex_ungetc(c, fp);
       return token.type = '[';
     }
     if (c == ']') {
-      if ((c = getc(fp)) == ']')
+      if ((c = lex_getc(fp)) == ']')
         return token.type = RBRACKETS;
-      ungetc(c, fp);
+      lex_ungetc(c, fp);
       return token.type = ']';
     }
     if (c == '=')
@@ -285,77 +1088,81 @@ static int lex_scan(FILE *fp) {
     if (c == '.')
       return token.type = '.';
     if (c == '"') {
-      if ((c = getc(fp)) == '"') {
-        if ((c = getc(fp)) == '"') /* Got """ */
+      if ((c = lex_getc(fp)) == '"') {
+        if ((c = lex_getc(fp)) == '"') /* Got """ */
           return token.type = lex_scan_ml_string(fp);
-        ungetc(c, fp);
-        token.lexeme[0] = '\0'; /* Got an empty string. */
+        lex_ungetc(c, fp);
+        lex_begin(true); /* Got an empty string. */
+        lex_end();
         return token.type = STRING;
       }
-      ungetc(c, fp);
+      lex_ungetc(c, fp);
       return token.type = lex_scan_string(fp);
     }
     if (c == '\'') {
-      if ((c = getc(fp)) == '\'') {
-        if ((c = getc(fp)) == '\'') /* Got ''' */
+      if ((c = lex_getc(fp)) == '\'') {
+        if ((c = lex_getc(fp)) == '\'') /* Got ''' */
           return token.type = lex_scan_ml_literal_string(fp);
-        ungetc(c, fp);
-        token.lexeme[0] = '\0'; /* Got an empty string. */
+        lex_ungetc(c, fp);
+        lex_begin(true); /* Got an empty string. */
+        lex_end();
         return token.type = STRING;
       }
-      ungetc(c, fp);
+      lex_ungetc(c, fp);
       return token.type = lex_scan_literal_string(fp);
     }
     if (c == '0') {
       int savedc = c;
-      char *p = token.lexeme;
 
-      *p++ = c;
-      c = getc(fp);
+      lex_begin(false);
+      lex_putc(c);
+      c = lex_getc(fp);
       if (c == 'x') { /* hexadecimal */
-        for (*p++ = c; isxdigit(c = getc(fp)) || c == '_';)
-          *p++ = c; /* FIXME: validate size */
-        *p = '\0';
-        ungetc(c, fp);
+        for (lex_putc(c); inclass(c = lex_getc(fp), C_HEX) || c == '_';)
+          lex_putc(c);
+        lex_end();
+        lex_ungetc(c, fp);
         return token.type = HEX_INTEGER;
       }
       if (c == 'o') { /* octal */
-        for (*p++ = c; ((c = getc(fp)) >= '0' && c <= '7') || c == '_';)
-          *p++ = c; /* FIXME: validate size */
-        *p = '\0';
-        ungetc(c, fp);
+        for (lex_putc(c); ((c = lex_getc(fp)) >= '0' && c <= '7') || c == '_';)
+          lex_putc(c);
+        lex_end();
+        lex_ungetc(c, fp);
         return token.type = OCT_INTEGER;
       }
       if (c == 'b') { /* binary */
-        for (*p++ = c; (c = getc(fp)) == '0' || c == '1' || c == '_';)
-          *p++ = c; /* FIXME: validate size */
-        *p = '\0';
-        ungetc(c, fp);
+        for (lex_putc(c); (c = lex_getc(fp)) == '0' || c == '1' || c == '_';)
+          lex_putc(c);
+        lex_end();
+        lex_ungetc(c, fp);
         return token.type = BIN_INTEGER;
       }
-      ungetc(c, fp); /* was not a prefix, put it back */
+      lex_ungetc(c, fp); /* was not a prefix, put it back */
       c = savedc;
     }
 
     if (c == '+' || c == '-') {
       int nextc = lex_peek(fp);
-      if (isdigit(nextc))
+      if (inclass(nextc, C_DIGIT))
         return token.type = lex_scan_number(c, fp); /* INTEGER, FLOAT */
       if (nextc == 'i') {
-        (void) getc(fp); /* consume i */
-        if (getc(fp) == 'n') {
-          if (getc(fp) == 'f') {
-            sprintf(token.lexeme, "%cinf", c);
+        (void) lex_getc(fp); /* consume i */
+        if (lex_getc(fp) == 'n') {
+          if (lex_getc(fp) == 'f') {
+            token.text = token.lexeme;
+            token.len = sprintf(token.lexeme, "%cinf", c);
             return token.type = FLOAT;
           }
         }
         error_printf("invalid float");
       }
       if (nextc == 'n') {
-        (void) getc(fp); /* consume n */
-        if (getc(fp) == 'a') {
-          if (getc(fp) == 'n') {
-            sprintf(token.lexeme, "%cnan", c);
+        (void) lex_getc(fp); /* consume n */
+        if (lex_getc(fp) == 'a') {
+          if (lex_getc(fp) == 'n') {
+            token.text = token.lexeme;
+            token.len = sprintf(token.lexeme, "%cnan", c);
             return token.type = FLOAT;
           }
         }
@@ -363,20 +1170,18 @@ static int lex_scan(FILE *fp) {
       }
       error_printf("only numbers can start with + or -");
     }
-    if (isdigit(c))
+    if (inclass(c, C_DIGIT))
       return token.type = lex_scan_number(c, fp); /* INTEGER, FLOAT */
 
     /* keywords: inf, nan, true, false */
 
     /* FIXME: could also start with '-' or '_' or digit. */
-    if (isalpha(c)) {
-      char *p = token.lexeme;
-
-      for (*p++ = c;
-           isalpha(c = getc(fp)) || isdigit(c) || c == '-' || c == '_';)
-        *p++ = c; /* FIXME: validate token size */
-      *p = '\0';
-      ungetc(c, fp);
+    if (inclass(c, C_ALPHA)) {
+      lex_begin(false);
+      for (lex_putc(c); inclass(c = lex_getc(fp), C_BARE);)
+        lex_putc(c);
+      lex_end();
+      lex_ungetc(c, fp);
       return token.type = BARE_KEY;
     }
 
@@ -387,16 +1192,131 @@ static int lex_scan(FILE *fp) {
 
     return token.type = c; /* anything else */
   }
-  return EOF;
+  return token.type = EOF;
+}
+
+/* The second bracket of a [[ or ]] token split by split_brackets. */
+static _Thread_local int pending;
+
+/* Splits a [[ or ]] token, which in a value are two nested arrays
+   opening or closing, into two tokens. */
+static void split_brackets(void) {
+  token.type = pending = token.type == LBRACKETS ? '[' : ']';
+}
+
+/* lex_token returns the next token, scanned from the input or, when
+   unmarshaling a tokenized document, read back from the tape. */
+static int lex_token(void) {
+  const struct toml_token *t;
+
+  if (pending != 0) {
+    token.type = pending;
+    pending = 0;
+    return token.type;
+  }
+  if (tape == NULL)
+    return lex_scan(inputfp);
+  if (tapepos == tape->count)
+    return token.type = EOF;
+  t = &tape->tokens[tapepos++];
+  lexgrown = false;
+  token.text = tape->store + t->offset;
+  token.len = t->len;
+  if (t->type == NEWLINE)
+    token.lineno++;
+  return token.type = t->type;
+}
+
+/* lex_next returns the next token, see lex_token. */
+static int lex_next(void) {
+  PROFILE_ENTER(toml_lex_phase);
+  lex_token();
+  PROFILE_LEAVE();
+  tstats.tokens++;
+  high_water(&tstats.max_lexeme, token.len);
+  return token.type;
 }
 
 void keyval();
+void inline_table();
+
+enum {
+  MAXSECTIONS = 64,    /* most sections a document is split into */
+  MAXTABLEARRAYS = TOML_FEED_MAXTABLEARRAYS, /* most arrays of tables */
+  MAXTABLES = TOML_FEED_MAXTABLES, /* most [ table ]s in a split document */
+};
+
+/* A run of lines of a document, starting at a top-level header or at
+   the beginning of the document, that can be parsed on its own. */
+struct section {
+  const struct split *split;
+  const char *start;
+  size_t len;
+  int lineno;
+  /* The number of elements of each array of tables of the split in
+     the sections before this one. */
+  int counts[MAXTABLEARRAYS];
+};
+
+/* A document split into sections. */
+struct split {
+  const struct toml_key *template;
+  const char *buf;           /* the document */
+  struct toml_trace *trace; /* see toml_trace */
+  /* The arrays of tables that have [[ header ]]s in the document. */
+  const struct toml_key *tablearrays[MAXTABLEARRAYS];
+  int ntablearrays;
+  /* The number of elements of each of them in the whole document. */
+  int counts[MAXTABLEARRAYS];
+  /* The [ table ]s defined in the document. */
+  const struct toml_key *tables[MAXTABLES];
+  int ntables;
+  struct section sections[MAXSECTIONS];
+  int nsections;
+};
+
+/* Returns where the value stored at p goes, see reloc. */
+static void *relocate(const void *p) {
+  char *addr = (char *) p;
+
+  if (addr >= reloc.lo && addr < reloc.hi)
+    addr += reloc.delta;
+  return addr;
+}
+
+/* Returns a copy of the array a with its pointers relocated. */
+static struct toml_array relocate_array(const struct toml_array *a) {
+  struct toml_array r = *a;
+
+  r.count = relocate(a->count);
+  r.shape = relocate(a->shape);
+  switch (a->type) {
+  case toml_string_t:
+    r.u.strings.ptrs = relocate(a->u.strings.ptrs);
+    r.u.strings.store = relocate(a->u.strings.store);
+    break;
+  case toml_variant_t:
+    r.u.variants.elems = relocate(a->u.variants.elems);
+    r.u.variants.store = relocate(a->u.variants.store);
+    break;
+  case toml_table_t:
+    r.u.tables.base = relocate(a->u.tables.base);
+    break;
+  default: /* the rest are a single pointer to the elements */
+    r.u.real = relocate(a->u.real);
+    break;
+  }
+  return r;
+}
 
-static char *target_address(const struct toml_key *cursor,
-                            const struct toml_array *array, int offset) {
+/* Returns the address of the value of the key cursor. Keys of the
+   elements of an array of tables are offsets from curbase. */
+static char *target_address(const struct toml_key *cursor) {
   char *addr = NULL;
 
-  if (array == NULL) {
+  if (curbase != NULL) {
+    addr = curbase + cursor->u.offset;
+  } else {
     switch (cursor->type) {
     case toml_short_t:
       addr = (char *) cursor->u.integer.s;
@@ -425,197 +1345,725 @@ static char *target_address(const struct toml_key *cursor,
     case toml_string_t:
       addr = cursor->u.string;
       break;
+    case toml_strview_t:
+      addr = (char *) cursor->u.strview.view;
+      break;
     default:
       break;
     }
-  } else {
-    addr = array->u.tables.base + (offset * array->u.tables.structsize) +
-           cursor->u.offset;
+    addr = relocate(addr);
   }
-  log_print("target address for %s is %p.\n", cursor->name, addr);
   return addr;
 }
 
-static void array() {
-  const struct toml_array *array = &cursor->u.array;
-  char *sp = array->u.strings.store;
-  size_t offset = 0;
+/* Returns the address of element n of the array of tables a. */
+static char *table_address(const struct toml_array *a, size_t n) {
+  return a->u.tables.base + n * a->u.tables.structsize;
+}
 
-  do {
-    while (lex_scan(inputfp) == NEWLINE)
-      ;
-    if (token.type == ']') /* end of array */
-      break;
-    if (token.type == ',') {
-      log_print("Invalid syntax: got ',' when expecting token.\n");
-      exit(1);
-    }
-    if (offset >= array->len) {
-      log_print("Too many elements in array.\n");
-      exit(1);
+/* The keys given a value by a parse of a compiled template are marked
+   in its set bitmask, which makes finding a key defined twice a test of
+   its bit. Each table of the template has its bits from its first; the
+   table of the last key is cached, as keys mostly follow others of the
+   same table. */
+enum { LONGBITS = 8 * sizeof(unsigned long) };
+
+static _Thread_local struct {
+  const struct toml_key *keys;
+  unsigned int first;
+} lastmark;
+
+/* Returns the index of the table tab in the compiled template t. */
+static int template_table(const struct toml_template *t,
+                          const struct toml_key *tab) {
+  for (int i = 0; i < t->ntables; i++) {
+    if (t->tables[i].keys == tab)
+      return i;
+  }
+  return -1;
+}
+
+/* Returns the bit of the key k of the table tab. */
+static size_t key_bit(const struct toml_key *tab, const struct toml_key *k) {
+  if (lastmark.keys != tab) {
+    int i = template_table(compiled, tab);
+
+    if (i < 0)
+      error_printf("table of '%s' was not compiled", k->name);
+    lastmark.keys = tab;
+    lastmark.first = compiled->tables[i].first;
+  }
+  return lastmark.first + (k - tab);
+}
+
+static void mark(const struct toml_key *tab, const struct toml_key *k) {
+  size_t bit;
+
+  if (compiled == NULL)
+    return;
+  bit = key_bit(tab, k);
+  if (compiled->set[bit / LONGBITS] & (1ul << (bit % LONGBITS)))
+    error_printf("'%s' is defined twice", k->name);
+  compiled->set[bit / LONGBITS] |= 1ul << (bit % LONGBITS);
+}
+
+/* Marks the table k of tab, which a dotted key defines a key of, so
+   that a [ table ] header may not define it again. Other dotted keys
+   may. */
+static void mark_dotted(const struct toml_key *tab, const struct toml_key *k) {
+  size_t bit;
+
+  if (compiled == NULL)
+    return;
+  bit = key_bit(tab, k);
+  compiled->set[bit / LONGBITS] |= 1ul << (bit % LONGBITS);
+}
+
+/* Fails if the table tab, which ends, was not given all of its required
+   keys. The bits of tab are compared a word at a time. */
+static void check_required(const struct toml_key *tab) {
+  size_t first, end;
+  int i;
+
+  if (compiled == NULL || (i = template_table(compiled, tab)) < 0)
+    return;
+  first = compiled->tables[i].first;
+  end = first + compiled->tables[i].n;
+  for (size_t w = first / LONGBITS; w * LONGBITS < end; w++) {
+    unsigned long missing = compiled->required[w] & ~compiled->set[w];
+
+    if (w == first / LONGBITS)
+      missing &= ~0ul << (first % LONGBITS);
+    if ((w + 1) * LONGBITS > end && end % LONGBITS != 0)
+      missing &= ~(~0ul << (end % LONGBITS));
+    if (missing != 0) {
+      size_t bit = w * LONGBITS + __builtin_ctzl(missing);
+      error_printf("missing required key '%s'", tab[bit - first].name);
     }
+  }
+}
 
-    switch (token.type) {
-    case STRING: {
-      size_t used, free, len;
+/* Fails if the table tab, or any of its tables, was not given all of
+   its required keys, whether the document has the table or not. Each
+   element of an array of tables is checked as it ends; the last one is
+   checked again here, with its tables. */
+static void check_tables(const struct toml_key *tab) {
+  if (compiled == NULL)
+    return;
+  check_required(tab);
+  for (const struct toml_key *k = tab; k->name != NULL; k++) {
+    if (k->type == toml_table_t)
+      check_tables(k->u.table);
+    else if (k->type == toml_array_t && k->u.array.type == toml_table_t &&
+             k->u.array.count != NULL &&
+             *(int *) relocate(k->u.array.count) > 0)
+      check_tables(k->u.array.u.tables.subtype);
+  }
+}
 
-      if (array->type != toml_string_t) {
-        log_print("not expecting a string.\n");
-        exit(1);
-      }
-      array->u.strings.ptrs[offset] = sp;
-      used = sp - array->u.strings.store;
-      free = array->u.strings.storelen - used;
-      len = strlen(token.lexeme);
-      if (len + 1 > free) {
-        log_print("Ran out of storage for strings.\n");
-        exit(1);
+/* Clears the marks of the keys of tab and of its tables, as a new
+   element of an array of tables starts. */
+static void unmark(const struct toml_key *tab) {
+  int i;
+
+  if (compiled == NULL || (i = template_table(compiled, tab)) < 0)
+    return;
+  for (size_t bit = compiled->tables[i].first;
+       bit < compiled->tables[i].first + compiled->tables[i].n; bit++)
+    compiled->set[bit / LONGBITS] &= ~(1ul << (bit % LONGBITS));
+  for (const struct toml_key *k = tab; k->name != NULL; k++) {
+    if (k->type == toml_table_t)
+      unmark(k->u.table);
+  }
+}
+
+/* Returns the size of an element of the array a. */
+static size_t element_size(const struct toml_array *a) {
+  switch (a->type) {
+  case toml_short_t:
+  case toml_ushort_t:
+    return sizeof(short);
+  case toml_int_t:
+  case toml_uint_t:
+    return sizeof(int);
+  case toml_long_t:
+  case toml_ulong_t:
+    return sizeof(long);
+  case toml_float_t:
+    return sizeof(double);
+  case toml_bool_t:
+    return sizeof(bool);
+  case toml_string_t:
+    return sizeof(char *);
+  case toml_variant_t:
+    return sizeof(struct toml_variant);
+  case toml_table_t:
+    return a->u.tables.structsize;
+  default:
+    return 0;
+  }
+}
+
+/* Returns the address of the elements of a. */
+static char *array_elements(const struct toml_array *a) {
+  switch (a->type) {
+  case toml_string_t:
+    return (char *) a->u.strings.ptrs;
+  case toml_variant_t:
+    return (char *) a->u.variants.elems;
+  case toml_table_t:
+    return a->u.tables.base;
+  default: /* the rest are a single pointer to the elements */
+    return (char *) a->u.real;
+  }
+}
+
+static void set_array_elements(struct toml_array *a, char *p) {
+  switch (a->type) {
+  case toml_string_t:
+    a->u.strings.ptrs = (char **) p;
+    break;
+  case toml_variant_t:
+    a->u.variants.elems = (struct toml_variant *) p;
+    break;
+  case toml_table_t:
+    a->u.tables.base = p;
+    break;
+  default:
+    a->u.real = (double *) p;
+    break;
+  }
+}
+
+/* Tells whether n elements fill an array of capacity len, once grown
+   as by grow_array. */
+static bool array_full(size_t n, size_t len) {
+  if (n < len)
+    return false;
+  if (len == 0)
+    return (n & (n - 1)) == 0;
+  return n % len == 0 && ((n / len) & (n / len - 1)) == 0;
+}
+
+/* Moves the n elements of the array a of the key k, which fill it, to
+   storage from the allocator of k with room for twice as many. */
+static void grow_array(const struct toml_key *k, struct toml_array *a,
+                       size_t n) {
+  const struct toml_allocator *alloc = k->alloc;
+  size_t size = element_size(a);
+  char *p;
+
+  if (alloc == NULL || k->data == NULL) {
+    trace(toml_array_full_event, cursor->name);
+    fail(1);
+  }
+  p = allocate(alloc, (n > 0 ? 2 * n : 1) * size);
+  memcpy(p, array_elements(a), n * size);
+  if (n > a->len && alloc->free != NULL)
+    alloc->free(alloc->ctx, array_elements(a), n * size);
+  set_array_elements(a, p);
+}
+
+/* The state of an array value being parsed. */
+struct array_state {
+  struct toml_array a;
+  char *block, *sp, *send; /* the block strings go to, and its free part */
+  size_t offset;           /* the number of elements stored */
+  size_t stored;           /* the bytes of strings stored */
+  int rank;                /* the depth of the innermost arrays, once seen */
+  unsigned long seen;      /* the depths whose length is in the shape */
+};
+
+/* Stores the string token in the store of the array. */
+static char *array_string(struct array_state *st) {
+  size_t len = token.len;
+
+  if (lexgrown) { /* the next strings go after it, in its storage */
+    st->block = st->sp = token.text;
+    st->send = lexend + 1;
+  }
+  if (token.text != st->sp) { /* was not scanned in place */
+    if (len + 1 > (size_t) (st->send - st->sp)) {
+      size_t size = 2 * (st->send - st->block);
+
+      if (cursor->alloc == NULL || cursor->data == NULL) {
+        trace(toml_strings_full_event, cursor->name);
+        fail(1);
       }
-      memcpy(sp, token.lexeme, len);
-      sp[len] = '\0';
-      sp = sp + len + 1;
-      break;
+      if (size < len + 1)
+        size = len + 1;
+      st->block = st->sp = allocate(cursor->alloc, size);
+      st->send = st->sp + size;
     }
-    case INTEGER:
-    case HEX_INTEGER:
-    case OCT_INTEGER:
-    case BIN_INTEGER: {
-      char *endptr;
-      long val;
-
-      errno = 0;
-      val = strtol(token.lexeme, &endptr, 0);
-      if (errno != 0 || token.lexeme == endptr) {
-        log_print("Error parsing a number.\n");
-        exit(1);
-      }
-      switch (array->type) {
-      case toml_short_t:
-        array->u.integer.s[offset] = (short) val;
-        break;
-      case toml_ushort_t:
-        array->u.integer.us[offset] = (unsigned short) val;
-        break;
-      case toml_int_t:
-        array->u.integer.i[offset] = (int) val;
-        break;
-      case toml_uint_t:
-        array->u.integer.ui[offset] = (unsigned int) val;
-        break;
-      case toml_long_t:
-        array->u.integer.l[offset] = val;
-        break;
-      case toml_ulong_t:
-        array->u.integer.ul[offset] = (unsigned long) val;
+    PROFILE_ENTER(toml_store_phase);
+    memcpy(st->sp, token.text, len + 1);
+    PROFILE_LEAVE();
+    tstats.strings++;
+    tstats.stringbytes += len;
+  }
+  st->sp += len + 1;
+  st->stored += len + 1;
+  return st->sp - len - 1;
+}
+
+/* Stores val as element offset of the integer array a. */
+static void store_integer(struct toml_array *a, size_t offset, long val) {
+  switch (a->type) {
+  case toml_short_t:
+    a->u.integer.s[offset] = (short) val;
+    break;
+  case toml_ushort_t:
+    a->u.integer.us[offset] = (unsigned short) val;
+    break;
+  case toml_int_t:
+    a->u.integer.i[offset] = (int) val;
+    break;
+  case toml_uint_t:
+    a->u.integer.ui[offset] = (unsigned int) val;
+    break;
+  case toml_long_t:
+    a->u.integer.l[offset] = val;
+    break;
+  case toml_ulong_t:
+    a->u.integer.ul[offset] = (unsigned long) val;
+    break;
+  default:
+    trace(toml_type_event, cursor->name);
+    fail(1);
+  }
+}
+
+/* Checks that a matrix has its elements depth deep, as the others. */
+static void array_leaf(struct array_state *st, int depth) {
+  if (st->a.shape != NULL && st->a.type != toml_variant_t) {
+    if (st->rank != 0 && st->rank != depth + 1)
+      error_printf("arrays of a matrix nested to different depths");
+    st->rank = depth + 1;
+  }
+}
+
+/* Parses the decimal digits at p into *val, eight at a time while
+   there are, and returns the end of the digits. Only the value of up
+   to 19 digits is right. */
+static const unsigned char *decimal(const unsigned char *p,
+                                    const unsigned char *end,
+                                    unsigned long long *val) {
+  unsigned long long v = 0;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  while (end - p >= 8) {
+    unsigned long long x;
+
+    memcpy(&x, p, 8);
+    if ((x & 0xf0f0f0f0f0f0f0f0) != 0x3030303030303030 ||
+        ((x + 0x0606060606060606) & 0xf0f0f0f0f0f0f0f0) !=
+            0x3030303030303030)
+      break; /* not eight digits */
+    x -= 0x3030303030303030;
+    x = (x * 10 + (x >> 8)) & 0x00ff00ff00ff00ff;
+    x = (x * 100 + (x >> 16)) & 0x0000ffff0000ffff;
+    x = (x * 10000 + (x >> 32)) & 0xffffffff;
+    v = v * 100000000 + x;
+    p += 8;
+  }
+#endif
+  while (p < end && inclass(*p, C_DIGIT))
+    v = v * 10 + (*p++ - '0');
+  *val = v;
+  return p;
+}
+
+/* Parses the elements of an array of integers or floats straight from
+   the input in memory, while they are plain decimal numbers followed
+   by ',' or ']', and returns how many there were. It stops before
+   anything else, the ']' included, for array_items to go on with. */
+static size_t array_numbers(struct array_state *st, int depth) {
+  static const double pow10[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,
+                                 1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                                 1e12, 1e13, 1e14, 1e15};
+  struct toml_array *array = &st->a;
+  const unsigned char *p = inp, *end = inend;
+  int lineno = token.lineno;
+  size_t n = 0;
+
+  PROFILE_ENTER(toml_convert_phase);
+  for (;;) {
+    const unsigned char *s = p, *q; /* p is past the elements taken */
+    unsigned long long m, frac;
+    bool neg = false;
+    double real = 0;
+    int l = lineno;
+
+    while (s < end && inclass(*s, C_SPACE | C_NEWLINE))
+      l += *s++ == '\n';
+    if (s < end && (*s == '+' || *s == '-'))
+      neg = *s++ == '-';
+    q = decimal(s, end, &m);
+    if (q == s || q - s > 18 || (*s == '0' && q - s > 1))
+      break; /* none, too many, or leading zeros */
+    if (array->type == toml_float_t) {
+      const unsigned char *r;
+
+      if (q == end || *q != '.')
         break;
-      default:
-        log_print("not expecting an integer value.\n");
-        exit(1);
-      }
+      r = decimal(q + 1, end, &frac);
+      if (r == q + 1 || (q - s) + (r - q - 1) > 15)
+        break; /* not exact in a double */
+      real = (double) (m * (unsigned long long) pow10[r - q - 1] + frac) /
+             pow10[r - q - 1];
+      q = r;
+    }
+    while (q < end && inclass(*q, C_SPACE | C_NEWLINE))
+      l += *q++ == '\n';
+    if (q == end || (*q != ',' && *q != ']'))
+      break; /* '_', 'e', a comment, or an error */
+
+    if (array_full(st->offset, array->len))
+      grow_array(cursor, array, st->offset);
+    array_leaf(st, depth);
+    if (array->type == toml_float_t)
+      array->u.real[st->offset] = neg ? -real : real;
+    else
+      store_integer(array, st->offset, neg ? -(long) m : (long) m);
+    st->offset++;
+    n++;
+    lineno = l;
+    if (*q == ']') {
+      p = q;
       break;
     }
-    case FLOAT: {
-      char *endptr;
-      double val;
+    p = q + 1;
+  }
+  if (n > 0) {
+    inp = p;
+    token.lineno = lineno;
+  }
+  PROFILE_LEAVE();
+  return n;
+}
 
-      if (array->type != toml_float_t) {
-        log_print("Saw float when not expecting a real value.\n");
-        exit(1);
-      }
-      errno = 0;
-      val = strtod(token.lexeme, &endptr);
-      if (errno != 0 || token.lexeme == endptr) {
-        log_print("Error parsing a number.\n");
-        exit(1);
-      }
+/* Stores the value of the token as the next element of the array. */
+static void array_element(struct array_state *st) {
+  struct toml_array *array = &st->a;
+  size_t offset = st->offset;
+  struct toml_variant *v = NULL;
+
+  if (array->type == toml_variant_t)
+    v = &array->u.variants.elems[offset];
+
+  switch (token.type) {
+  case STRING: {
+    char *p;
+
+    if (array->type != toml_string_t && v == NULL) {
+      trace(toml_type_event, cursor->name);
+      fail(1);
+    }
+    p = array_string(st);
+    if (v != NULL) {
+      v->type = toml_string_t;
+      v->u.string = p;
+    } else
+      array->u.strings.ptrs[offset] = p;
+    break;
+  }
+  case INTEGER:
+  case HEX_INTEGER:
+  case OCT_INTEGER:
+  case BIN_INTEGER: {
+    char *endptr;
+    long val;
+
+    PROFILE_ENTER(toml_convert_phase);
+    errno = 0;
+    val = strtol(token.text, &endptr, 0);
+    if (errno != 0 || token.text == endptr) {
+      trace(toml_number_event, cursor->name);
+      fail(1);
+    }
+    PROFILE_LEAVE();
+    PROFILE_ENTER(toml_store_phase);
+    if (v != NULL) {
+      v->type = toml_long_t;
+      v->u.integer = val;
+    } else
+      store_integer(array, offset, val);
+    PROFILE_LEAVE();
+    break;
+  }
+  case FLOAT: {
+    char *endptr;
+    double val;
+
+    if (array->type != toml_float_t && v == NULL) {
+      trace(toml_type_event, cursor->name);
+      fail(1);
+    }
+    PROFILE_ENTER(toml_convert_phase);
+    errno = 0;
+    val = strtod(token.text, &endptr);
+    if (errno != 0 || token.text == endptr) {
+      trace(toml_number_event, cursor->name);
+      fail(1);
+    }
+    PROFILE_LEAVE();
+    PROFILE_ENTER(toml_store_phase);
+    if (v != NULL) {
+      v->type = toml_float_t;
+      v->u.real = val;
+    } else
       array->u.real[offset] = val;
-      break;
+    PROFILE_LEAVE();
+    break;
+  }
+  case BARE_KEY: {
+    bool val;
+
+    if (strcmp(token.text, "true") == 0)
+      val = true;
+    else if (strcmp(token.text, "false") == 0)
+      val = false;
+    else {
+      trace(toml_boolean_event, cursor->name);
+      fail(1);
     }
-    case BARE_KEY: {
-      // case TRUE:
-      // case FALSE:
-      // {
-      //   array->u.boolean[offset] = strcmp(token.lexeme, "true") == 0;
-      // }
-      bool val;
-
-      if (strcmp(token.lexeme, "true") == 0)
-        val = true;
-      else if (strcmp(token.lexeme, "false") == 0)
-        val = false;
-      else {
-        log_print("Got '%s' when expecting boolean.\n", token.lexeme);
-        exit(1);
-      }
+    if (v != NULL) {
+      v->type = toml_bool_t;
+      v->u.boolean = val;
+    } else
       array->u.boolean[offset] = val;
-      break;
+    break;
+  }
+  case '{': { /* inline-tables [ { }, { } ] */
+    const struct toml_key *savedtab = curtab, *savedcursor = cursor;
+    char *savedbase = curbase;
+
+    if (array->type != toml_table_t) {
+      trace(toml_type_event, cursor->name);
+      fail(1);
     }
-    case '{':  // inline-tables [ { }, { } ]
-      if (cursor->u.array.type != toml_table_t) {
-        log_print("Saw { when not expecting inline table.\n");
-        exit(1);
-      }
+    curtab = array->u.tables.subtype;
+    curbase = table_address(array, offset);
+    unmark(curtab);
+    inline_table();
+    curtab = savedtab, cursor = savedcursor, curbase = savedbase;
+    break;
+  }
+  }
+  st->offset++;
+}
+
+static size_t array_items(struct array_state *st, int depth);
+
+/* Parses an array nested depth deep in the array. The elements of a
+   matrix are stored flat; a variant array stores a variant for the
+   nested array before its elements. */
+static void nested_array(struct array_state *st, int depth) {
+  struct toml_array *array = &st->a;
+
+  if (array->type == toml_variant_t) {
+    size_t at = st->offset++;
+    size_t n = array_items(st, depth + 1);
+    struct toml_variant *v = &array->u.variants.elems[at];
+
+    v->type = toml_array_t;
+    v->u.array.count = n;
+    v->u.array.size = st->offset - at - 1;
+    return;
+  }
+  if (depth + 1 >= array->rank) {
+    trace(toml_depth_event, cursor->name);
+    fail(1);
+  }
+  if (st->rank != 0 && st->rank <= depth + 1)
+    error_printf("arrays of a matrix nested to different depths");
+  array_items(st, depth + 1);
+}
+
+/* Parses the items of an array nested depth deep, up to its ']', and
+   returns how many there were. */
+static size_t array_items(struct array_state *st, int depth) {
+  struct toml_array *array = &st->a;
+  bool numbers = array->type <= toml_float_t && inp != NULL && tape == NULL;
+  size_t n = 0;
+
+  do {
+    if (numbers && pending == 0)
+      n += array_numbers(st, depth);
+    if (array->type == toml_string_t || array->type == toml_variant_t) {
+      lex_sink(st->sp, st->send - st->sp, true); /* scan strings in place */
+      if (cursor->data != NULL)
+        sink.alloc = cursor->alloc;
+    }
+    while (lex_next() == NEWLINE)
+      ;
+    lex_sink(NULL, 0, false);
+    if (token.type == LBRACKETS || token.type == RBRACKETS)
+      split_brackets();
+    if (token.type == ']') /* end of array */
       break;
+    if (token.type == ',') {
+      trace(toml_syntax_event, cursor->name);
+      fail(1);
+    }
+    if (array_full(st->offset, array->len))
+      grow_array(cursor, array, st->offset);
+
+    if (token.type == '[')
+      nested_array(st, depth);
+    else {
+      array_leaf(st, depth);
+      array_element(st);
     }
-    offset++;
-    while (lex_scan(inputfp) == NEWLINE)
+    n++;
+    while (lex_next() == NEWLINE)
       ;
+    if (token.type == RBRACKETS)
+      split_brackets();
   } while (token.type == ',');
 
   if (token.type != ']')
     error_printf("expected ']'");
 
+  if (array->shape != NULL && depth < array->rank) {
+    if (!(st->seen & (1ul << depth))) {
+      array->shape[depth] = n;
+      st->seen |= 1ul << depth;
+    } else if ((size_t) array->shape[depth] != n)
+      error_printf("arrays of a matrix of different lengths");
+  }
+  return n;
+}
+
+static void array() {
+  struct array_state st = {relocate_array(&cursor->u.array)};
+  struct toml_array *array = &st.a;
+
+  if (array->type == toml_variant_t) {
+    st.block = array->u.variants.store;
+    st.send = st.block + array->u.variants.storelen;
+  } else {
+    st.block = array->u.strings.store;
+    st.send = st.block + array->u.strings.storelen;
+  }
+  st.sp = st.block;
+  if (array->shape != NULL) {
+    if (array->rank > (int) (8 * sizeof(st.seen)))
+      array->rank = 8 * sizeof(st.seen);
+    memset(array->shape, 0, array->rank * sizeof(int));
+  }
+  array_items(&st, 0);
+  high_water(&tstats.max_store, st.stored);
+  high_water(&tstats.max_elements, st.offset);
+
   if (array->count != NULL)
-    *(array->count) = offset;
+    *(array->count) = st.offset;
+  if (cursor->data != NULL)
+    *(char **) relocate(cursor->data) = array_elements(array);
 }
 
 void inline_table() {
-  do {
-    lex_scan(inputfp); /* FIXME: lex_next()??? */
+  if (lex_next() == '}') { /* empty table */
+    check_required(curtab);
+    return;
+  }
+  for (;;) {
     if (token.type == BARE_KEY || token.type == STRING)
       keyval();
     else
       error_printf("expected key");
-  } while (lex_scan(inputfp) == ',');
+    if (lex_next() != ',')
+      break;
+    lex_next();
+  }
 
   if (token.type != '}')
     error_printf("expected '}'");
+  check_required(curtab);
+}
+
+/* Stores the string token in the view of the key cursor. It was left in
+   the input, or stored in place if it had escapes; a string anywhere
+   else, as in token.lexeme, is copied to the storage of the key. */
+static void strview() {
+  struct toml_strview *v = (struct toml_strview *) target_address(cursor);
+  char *store = relocate(cursor->u.strview.store);
+
+  if (v == NULL)
+    return;
+  v->ptr = token.text;
+  v->len = token.len;
+  if (token.text == token.lexeme) {
+    if (cursor->size == 0)
+      error_printf("no storage for string '%s'", cursor->name);
+    if (v->len > cursor->size - 1)
+      v->len = cursor->size - 1;
+    memcpy(store, token.text, v->len);
+    store[v->len] = '\0';
+    v->ptr = store;
+    tstats.strings++;
+    tstats.stringbytes += v->len;
+  }
 }
 
 void value() {
+  trace(toml_value_event, cursor->name);
   switch (token.type) {
+  case LBRACKETS: /* an array of arrays */
+    split_brackets();
+    /* fall through */
   case '[':
     if (cursor->type != toml_array_t) {
-      log_print("Saw [ when not expecting array.\n");
+      trace(toml_type_event, cursor->name);
       // return ERR_UNEXPECTED_ARRAY;
-      exit(1);
+      fail(1);
     }
     // FIXME: handle errors
     array();
     break;
   case '{':
     if (cursor->type != toml_table_t) {
-      log_print("Saw { when not expecting table.\n");
+      trace(toml_type_event, cursor->name);
       // return ERR_UNEXPECTED_TABLE;
-      exit(1);
+      fail(1);
+    } else {
+      const struct toml_key *savedtab = curtab;
+
+      curtab = cursor->u.table;
+      inline_table();
+      curtab = savedtab;
     }
-    inline_table();
     break;
   case STRING: {
     char *p;
 
+    if (cursor->type == toml_strview_t) {
+      strview();
+      break;
+    }
     if (cursor->type != toml_string_t) {
-      log_print("saw quoted value when expecting non-string\n");
-      exit(1);
+      trace(toml_type_event, cursor->name);
+      fail(1);
     }
 
-    p = target_address(cursor, NULL, 0);
-    if (p == NULL)
+    p = target_address(cursor);
+    if (p == NULL || cursor->size == 0)
       return;
 
-    size_t s = cursor->size;
-    strncpy(p, token.lexeme, s - 1);
-    p[s - 1] = '\0';
+    if (lexgrown) /* it outgrew p */
+      p = token.text;
+    else if (token.text != p) { /* was not scanned in place */
+      size_t n = token.len < cursor->size - 1 ? token.len : cursor->size - 1;
+
+      PROFILE_ENTER(toml_store_phase);
+      memcpy(p, token.text, n);
+      p[n] = '\0';
+      PROFILE_LEAVE();
+      tstats.strings++;
+      tstats.stringbytes += n;
+    }
+    if (cursor->data != NULL)
+      *(char **) relocate(cursor->data) = p;
     break;
   }
   case FLOAT: {
@@ -624,21 +2072,25 @@ void value() {
     double val;
 
     if (cursor->type != toml_float_t) {
-      log_print("saw float value when not expecting a real.\n");
-      exit(1);
+      trace(toml_type_event, cursor->name);
+      fail(1);
     }
 
-    p = target_address(cursor, NULL, 0);
+    p = target_address(cursor);
     if (p == NULL)
       return;
 
+    PROFILE_ENTER(toml_convert_phase);
     errno = 0;
-    val = strtod(token.lexeme, &endptr);
-    if (errno != 0 || token.lexeme == endptr) {
-      log_print("Error parsing a number.\n");
-      exit(1);
+    val = strtod(token.text, &endptr);
+    if (errno != 0 || token.text == endptr) {
+      trace(toml_number_event, cursor->name);
+      fail(1);
     }
+    PROFILE_LEAVE();
+    PROFILE_ENTER(toml_store_phase);
     memcpy(p, &val, sizeof(double));
+    PROFILE_LEAVE();
     break;
   }
   case INTEGER:
@@ -649,16 +2101,19 @@ void value() {
     char *endptr;
     long val;
 
-    p = target_address(cursor, NULL, 0);
+    p = target_address(cursor);
     if (p == NULL)
       return;
 
+    PROFILE_ENTER(toml_convert_phase);
     errno = 0;
-    val = strtol(token.lexeme, &endptr, 0);
-    if (errno != 0 || token.lexeme == endptr) {
-      log_print("Not a valid number.\n");
-      exit(1);
+    val = strtol(token.text, &endptr, 0);
+    if (errno != 0 || token.text == endptr) {
+      trace(toml_number_event, cursor->name);
+      fail(1);
     }
+    PROFILE_LEAVE();
+    PROFILE_ENTER(toml_store_phase);
     switch (cursor->type) {
     case toml_short_t: {
       short tmp = (short) val;
@@ -689,28 +2144,33 @@ void value() {
       break;
     }
     default:
-      log_print("saw integer value when not expecting integers.\n");
-      exit(1);
+      trace(toml_type_event, cursor->name);
+      fail(1);
     }
+    PROFILE_LEAVE();
     break;
   }
   case BARE_KEY: {
     char *p;
     bool val;
 
-    p = target_address(cursor, NULL, 0);
+    p = target_address(cursor);
     if (p == NULL)
       return;
 
-    if (strcmp(token.lexeme, "true") == 0)
+    PROFILE_ENTER(toml_convert_phase);
+    if (strcmp(token.text, "true") == 0)
       val = true;
-    else if (strcmp(token.lexeme, "false") == 0)
+    else if (strcmp(token.text, "false") == 0)
       val = false;
     else {
-      log_print("Got '%s' when expecting boolean.\n", token.lexeme);
-      exit(1);
+      trace(toml_boolean_event, cursor->name);
+      fail(1);
     }
+    PROFILE_LEAVE();
+    PROFILE_ENTER(toml_store_phase);
     memcpy(p, &val, sizeof(bool));
+    PROFILE_LEAVE();
     break;
   }
   default:
@@ -718,52 +2178,219 @@ void value() {
   }
 }
 
-void key() {
-  /* simple-key or dotted-key */
-  for (cursor = curtab; cursor->name != NULL; cursor++) {
-    if (strcmp(cursor->name, token.lexeme) == 0)
-      break;
+enum {
+  HASHCACHE = 64, /* the tables whose hash lookup remembers, a power of 2 */
+};
+
+/* The perfect hashes of the tables looked up in during the parse of
+   generation gen, by the address of the table: the {NULL} key that
+   ends a table is walked to once per parse, not at each lookup. */
+static _Thread_local struct {
+  unsigned int gen;
+  struct {
+    const struct toml_key *tab;
+    const struct toml_hash *hash;
+    unsigned int gen;
+  } e[HASHCACHE];
+} hashes;
+
+/* Returns the 32-bit FNV-1a hash of name, its basis xored with seed,
+   mixed by the finalizer of MurmurHash3. Without it, the low bits that
+   pick slots depend only on the low bits of the seed, so few seeds
+   differ. */
+static unsigned int hash_name(unsigned int seed, const char *name) {
+  unsigned int h = 2166136261u ^ seed;
+
+  while (*name != '\0') {
+    h ^= (unsigned char) *name++;
+    h *= 16777619u;
   }
-  if (cursor->name == NULL) {
-    fprintf(stderr, "unknown key name '%s'\n", token.lexeme);
-    exit(2);
+  h ^= h >> 16;
+  h *= 0x85ebca6bu;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35u;
+  h ^= h >> 16;
+  return h;
+}
+
+/* Returns the perfect hash of the table tab, or NULL if it has none. */
+static const struct toml_hash *table_hash(const struct toml_key *tab) {
+  unsigned int i = ((uintptr_t) tab / sizeof(*tab)) & (HASHCACHE - 1);
+  const struct toml_key *k;
+
+  if (hashes.e[i].tab == tab && hashes.e[i].gen == hashes.gen)
+    return hashes.e[i].hash;
+  for (k = tab; k->name != NULL; k++)
+    ;
+  hashes.e[i].tab = tab;
+  hashes.e[i].hash = k->u.hash;
+  hashes.e[i].gen = hashes.gen;
+  return k->u.hash;
+}
+
+/* Returns the key named name in the template tab. */
+static const struct toml_key *lookup(const struct toml_key *tab,
+                                     const char *name) {
+  const struct toml_hash *hash = table_hash(tab);
+  const struct toml_key *k;
+
+  probe2(key, name, token.lineno);
+  PROFILE_ENTER(toml_lookup_phase);
+  tstats.lookups++;
+  if (hash != NULL) {
+    unsigned int seed = hash->seeds[hash_name(0, name) & hash->bmask];
+    unsigned int i = hash->slots[hash_name(seed, name) & hash->mask];
+
+    tstats.probes += i != 0;
+    if (i != 0 && strcmp(tab[i - 1].name, name) == 0) {
+      PROFILE_LEAVE();
+      return &tab[i - 1];
+    }
+  } else {
+    for (k = tab; k->name != NULL; k++) {
+      tstats.probes++;
+      if (strcmp(k->name, name) == 0) {
+        PROFILE_LEAVE();
+        return k;
+      }
+    }
   }
+  trace(toml_unknown_key_event, name);
+  lasterror.lineno = token.lineno;
+  lasterror.column = token.pos;
+  snprintf(lasterror.message, sizeof(lasterror.message),
+           "unknown key name '%s'", name);
+  if (errjmp == NULL)
+    fprintf(stderr, "%s\n", lasterror.message);
+  fail(2);
+}
 
-  while (lex_scan(inputfp) == '.') {
-    lex_scan(inputfp);
-    if (token.type == BARE_KEY || token.type == STRING)
-      puts(token.lexeme); /* key is used */
-    else
+/* Looks up a simple or dotted key. The tables a dotted key of a
+   key/value pair goes through are marked as defined by it, if dotted
+   is set; those of a header are not. */
+void key(bool dotted) {
+  /* simple-key or dotted-key */
+  const struct toml_key *tab = curtab;
+
+  for (;;) {
+    cursor = lookup(tab, token.text);
+    if (lex_next() != '.')
+      break;
+    if (cursor->type != toml_table_t)
+      error_printf("'%s' is not a table", cursor->name);
+    if (dotted)
+      mark_dotted(tab, cursor);
+    tab = cursor->u.table;
+    lex_next();
+    if (token.type != BARE_KEY && token.type != STRING)
       error_printf("expected dotted key");
   }
+  keytab = tab;
 }
 
 int accept(int type) {
   if (token.type == type) {
-    lex_scan(inputfp);
+    lex_next();
     return 1;
   }
   return 0;
 }
 
 void keyval() {
-  key();
-  if (accept('='))
+  key(true);
+  mark(keytab, cursor);
+  if (cursor->type == toml_string_t) { /* scan the value in place */
+    lex_sink(target_address(cursor), cursor->size, false);
+    if (cursor->data != NULL)
+      sink.alloc = cursor->alloc;
+  }
+  else if (cursor->type == toml_strview_t && copyviews)
+    lex_sink(relocate(cursor->u.strview.store), cursor->size, false);
+  else if (cursor->type == toml_strview_t) /* or leave it in the input */
+    lex_view(relocate(cursor->u.strview.store), cursor->size);
+  if (accept('=')) {
+    lex_sink(NULL, 0, false);
     value();
-  else
+  } else
     error_printf("missing '='");
 }
 
+/* Returns the number of elements seen so far in the array of tables
+   k, counted by its [[ header ]]s. A section parsed concurrently with
+   others keeps its own counts, which start from the number of elements
+   in the sections before it. */
+static int *table_count(const struct toml_key *k) {
+  int *count = k->u.array.count;
+
+  if (section != NULL) {
+    for (int i = 0; i < section->split->ntablearrays; i++) {
+      if (section->split->tablearrays[i] == k)
+        return &section->counts[i];
+    }
+    error_printf("array of tables '%s' not found by split", k->name);
+  }
+  if (count == NULL)
+    error_printf("no count for the array of tables '%s'", k->name);
+  return relocate(count);
+}
+
+/* Zeroes the count of every array of tables in the template tab, as
+   their elements are counted as the headers are seen. */
+static void reset_counts(const struct toml_key *tab) {
+  for (const struct toml_key *k = tab; k->name != NULL; k++) {
+    if (k->type == toml_table_t)
+      reset_counts(k->u.table);
+    else if (k->type == toml_array_t && k->u.array.type == toml_table_t) {
+      if (k->u.array.count != NULL)
+        *(int *) relocate(k->u.array.count) = 0;
+      reset_counts(k->u.array.u.tables.subtype);
+    }
+  }
+}
+
 void expression() {
   /* array-table = [[ key ]] */
   if (accept(LBRACKETS)) {
     switch (token.type) {
     case BARE_KEY:
-    case STRING:
-      key();
+    case STRING: {
+      struct toml_array array;
+      int *count;
+
+      check_required(curtab);
+      curtab = roottab, curbase = rootbase;
+      key(false);
       if (token.type != RBRACKETS)
         error_printf("missing ']]'");
+      if (cursor->type != toml_array_t ||
+          cursor->u.array.type != toml_table_t)
+        error_printf("'%s' is not an array of tables", cursor->name);
+      array = relocate_array(&cursor->u.array);
+      count = table_count(cursor);
+      trace(toml_table_event, cursor->name);
+      probe2(table, cursor->name, token.lineno);
+      if (section != NULL) { /* sections may not grow the array */
+        if ((size_t) *count >= array.len) {
+          trace(toml_array_full_event, cursor->name);
+          fail(1);
+        }
+      } else if (cursor->data != NULL) {
+        /* the elements are wherever the previous header left them */
+        char **data = relocate(cursor->data);
+
+        if (*count > 0)
+          array.u.tables.base = *data;
+        if (array_full(*count, array.len))
+          grow_array(cursor, &array, *count);
+        *data = array.u.tables.base;
+      } else if (array_full(*count, array.len))
+        grow_array(cursor, &array, *count);
+      curtab = array.u.tables.subtype;
+      curbase = table_address(&array, (*count)++);
+      high_water(&tstats.max_elements, *count);
+      unmark(curtab);
       break;
+    }
     default:
       error_printf("key was expected");
     }
@@ -773,9 +2400,17 @@ void expression() {
     switch (token.type) {
     case BARE_KEY:
     case STRING:
-      key();
-      if (token.type != RBRACKETS)
+      check_required(curtab);
+      curtab = roottab, curbase = rootbase;
+      key(false);
+      if (token.type != ']')
         error_printf("missing ']'");
+      if (cursor->type != toml_table_t)
+        error_printf("'%s' is not a table", cursor->name);
+      trace(toml_table_event, cursor->name);
+      probe2(table, cursor->name, token.lineno);
+      mark(keytab, cursor);
+      curtab = cursor->u.table;
       break;
     default:
       error_printf("key was expected");
@@ -790,22 +2425,1327 @@ void expression() {
   }
 }
 
-int toml_unmarshal(FILE *f, const struct toml_key *template) {
-  inputfp = f;
-  curtab = template;
-  token.lineno = 1;
-  while (lex_scan(inputfp) != EOF) {
+/* Parses the expressions of the input, which starts at line lineno. */
+static int parse(const struct toml_key *template, int lineno) {
+  long start = input_position(), end;
+
+  PROFILE_START();
+  roottab = curtab = template;
+  curbase = rootbase;
+  cursor = NULL;
+  hashes.gen++; /* the template may have changed since */
+  pending = 0;
+  token.lineno = lineno;
+  trace(toml_parse_event, NULL);
+  probe1(parse__start, lineno);
+  while (lex_next() != EOF) {
     if (token.type == NEWLINE)
       continue;
     expression();
-    if (lex_scan(inputfp) == EOF)
+    if (lex_next() == EOF)
       break;
     if (token.type != NEWLINE)
       error_printf("expected newline");
   }
+  check_required(curtab);
+  check_tables(roottab);
+  trace(toml_done_event, NULL);
+  probe1(parse__done, token.lineno);
+  PROFILE_STOP();
+  end = input_position();
+  if (start >= 0 && end > start)
+    tstats.bytes += end - start;
+  stats_flush();
   return 0;
 }
 
+void toml_stats_get(struct toml_stats *s) {
+  pthread_mutex_lock(&statslock);
+  *s = stats;
+  pthread_mutex_unlock(&statslock);
+}
+
+void toml_stats_reset(void) {
+  pthread_mutex_lock(&statslock);
+  memset(&stats, 0, sizeof(stats));
+  pthread_mutex_unlock(&statslock);
+}
+
+/* Parses the stream fp, or fd if fp is NULL. */
+static int unmarshal_stream(FILE *fp, int fd, const struct toml_key *template) {
+  int err;
+
+  read_stream(fp, fd, readwindow);
+  tape = NULL;
+  section = NULL;
+  reset_counts(template);
+  err = parse(template, 1);
+  read_done();
+  return err;
+}
+
+int toml_unmarshal(FILE *f, const struct toml_key *template) {
+  return unmarshal_stream(f, -1, template);
+}
+
+int toml_unmarshal_fd(int fd, const struct toml_key *template) {
+  return unmarshal_stream(NULL, fd, template);
+}
+
+int toml_unmarshal_base(const char *buf, size_t len,
+                        const struct toml_key *template, void *base) {
+  int err;
+
+  read_memory(buf, len);
+  tape = NULL;
+  section = NULL;
+  rootbase = base;
+  reset_counts(template);
+  err = parse(template, 1);
+  rootbase = NULL;
+  read_done();
+  return err;
+}
+
+/* Stores the default of the key k at p. */
+static void store_default(const struct toml_key *k, char *p) {
+  switch (k->type) {
+  case toml_short_t:
+    *(short *) p = (short) k->dflt.integer;
+    break;
+  case toml_ushort_t:
+    *(unsigned short *) p = (unsigned short) k->dflt.integer;
+    break;
+  case toml_int_t:
+    *(int *) p = (int) k->dflt.integer;
+    break;
+  case toml_uint_t:
+    *(unsigned int *) p = (unsigned int) k->dflt.integer;
+    break;
+  case toml_long_t:
+    *(long *) p = k->dflt.integer;
+    break;
+  case toml_ulong_t:
+    *(unsigned long *) p = (unsigned long) k->dflt.integer;
+    break;
+  case toml_float_t:
+    *(double *) p = k->dflt.real;
+    break;
+  case toml_bool_t:
+    *(bool *) p = k->dflt.boolean;
+    break;
+  case toml_strview_t: {
+    struct toml_strview *v = (struct toml_strview *) p;
+
+    v->ptr = k->dflt.string != NULL ? k->dflt.string : "";
+    v->len = strlen(v->ptr);
+    break;
+  }
+  case toml_string_t:
+    if (k->size == 0)
+      break;
+    p[0] = '\0';
+    if (k->dflt.string != NULL) {
+      strncpy(p, k->dflt.string, k->size - 1);
+      p[k->size - 1] = '\0';
+    }
+    break;
+  default:
+    break;
+  }
+}
+
+/* Numbers the keys of the table tab of t from *nbits, if it was not
+   seen before, and stores their defaults in the image. The storage is
+   relocated to the image, see toml_compile. */
+static int compile_table(struct toml_template *t, const struct toml_key *tab,
+                         size_t *nbits) {
+  char *lo = t->image, *hi = t->image + t->size;
+
+  if (template_table(t, tab) < 0) {
+    unsigned int n = 0;
+
+    if (t->ntables == TOML_TEMPLATE_MAXTABLES)
+      return -1;
+    while (tab[n].name != NULL)
+      n++;
+    t->tables[t->ntables].keys = tab;
+    t->tables[t->ntables].first = *nbits;
+    t->tables[t->ntables++].n = n;
+    if (*nbits + n > t->nbits)
+      return -1;
+    for (unsigned int i = 0; i < n; i++, (*nbits)++) {
+      if (tab[i].required)
+        t->required[*nbits / LONGBITS] |= 1ul << (*nbits % LONGBITS);
+    }
+  }
+  for (const struct toml_key *k = tab; k->name != NULL; k++) {
+    if (k->type == toml_table_t) {
+      if (compile_table(t, k->u.table, nbits) != 0)
+        return -1;
+    } else if (k->type == toml_array_t) {
+      const struct toml_array a = relocate_array(&k->u.array);
+      char *savedbase = curbase;
+
+      if ((char *) a.count >= lo && (char *) a.count < hi)
+        *a.count = 0;
+      if (a.type != toml_table_t)
+        continue;
+      for (size_t i = 0; i < a.len; i++) {
+        curbase = table_address(&a, i);
+        if (compile_table(t, a.u.tables.subtype, nbits) != 0)
+          return -1;
+      }
+      curbase = savedbase;
+    } else {
+      char *p = target_address(k);
+
+      if (p >= lo && p < hi)
+        store_default(k, p);
+    }
+  }
+  return 0;
+}
+
+int toml_compile(struct toml_template *t) {
+  size_t nbits = 0;
+  int err;
+
+  memcpy(t->image, t->base, t->size);
+  memset(t->required, 0, t->nbits / 8);
+  t->ntables = 0;
+  reloc.lo = t->base;
+  reloc.hi = (char *) t->base + t->size;
+  reloc.delta = t->image - (char *) t->base;
+  curbase = NULL;
+  err = compile_table(t, t->keys, &nbits);
+  reloc.lo = reloc.hi = NULL;
+  reloc.delta = 0;
+  return err;
+}
+
+int toml_unmarshal_compiled(FILE *f, struct toml_template *t) {
+  int err;
+
+  memcpy(t->base, t->image, t->size);
+  memset(t->set, 0, t->nbits / 8);
+  compiled = t;
+  lastmark.keys = NULL;
+  err = toml_unmarshal(f, t->keys);
+  compiled = NULL;
+  return err;
+}
+
+bool toml_isset(const struct toml_template *t, const struct toml_key *k) {
+  for (int i = 0; i < t->ntables; i++) {
+    const struct toml_key *tab = t->tables[i].keys;
+
+    if (k >= tab && k < tab + t->tables[i].n) {
+      size_t bit = t->tables[i].first + (k - tab);
+      return (t->set[bit / LONGBITS] >> (bit % LONGBITS)) & 1;
+    }
+  }
+  return false;
+}
+
+int toml_tokenize(FILE *f, struct toml_tape *t) {
+  size_t used = 0;
+
+  read_stream(f, -1, readwindow);
+  token.lineno = 1;
+  t->count = 0;
+  for (;;) {
+    struct toml_token *tok;
+
+    lex_sink(t->store + used, t->storelen - used, true);
+    if (lex_scan(inputfp) == EOF)
+      break;
+    if (t->count == t->len)
+      error_printf("ran out of storage for tokens");
+    tok = &t->tokens[t->count++];
+    tok->type = token.type;
+    tok->offset = used;
+    tok->len = 0;
+    switch (token.type) {
+    case STRING:
+    case BARE_KEY:
+    case INTEGER:
+    case HEX_INTEGER:
+    case OCT_INTEGER:
+    case BIN_INTEGER:
+    case FLOAT:
+      if (token.len + 1 > t->storelen - used ||
+          token.len >= TOML_TOKEN_MAXLEN)
+        error_printf("ran out of storage for tokens");
+      if (token.text != t->store + used) /* was not scanned in place */
+        memcpy(t->store + used, token.text, token.len + 1);
+      tok->len = token.len;
+      used += token.len + 1;
+      break;
+    }
+  }
+  lex_sink(NULL, 0, false);
+  read_done();
+  return 0;
+}
+
+int toml_unmarshal_tape(const struct toml_tape *t,
+                        const struct toml_key *template) {
+  tape = t;
+  tapepos = 0;
+  section = NULL;
+  reset_counts(template);
+  return parse(template, 1);
+}
+
+/* Returns the start of the line after the one p is in, skipping over
+   strings and comments, and counts the newlines passed in *lineno.
+   Multiline strings may span many lines. The brackets of the arrays
+   left open are counted in *depth, as a line of a nested array may
+   start with '[' too. */
+static const char *next_line(const char *p, const char *end, int *lineno,
+                             int *depth) {
+  while (p < end) {
+    int c = *p++;
+
+    if (c == '\n') {
+      (*lineno)++;
+      return p;
+    }
+    if (c == '[')
+      (*depth)++;
+    else if (c == ']' && *depth > 0)
+      (*depth)--;
+    else if (c == '#') {
+      if ((p = memchr(p, '\n', end - p)) == NULL)
+        return end;
+    } else if (c == '"' || c == '\'') {
+      bool ml = end - p >= 2 && p[0] == c && p[1] == c;
+
+      if (ml)
+        p += 2;
+      while (p < end) {
+        int d = *p++;
+
+        if (d == '\\' && c == '"' && p < end)
+          d = *p++; /* escaped character */
+        else if (d == c && (!ml || (end - p >= 2 && p[0] == c && p[1] == c))) {
+          if (ml) /* up to two quotes may precede the delimiter */
+            for (p += 2; p < end && *p == c; p++)
+              ;
+          break;
+        }
+        if (d == '\n') {
+          if (!ml)
+            return p - 1; /* let the parser report it */
+          (*lineno)++;
+        }
+      }
+    }
+  }
+  return end;
+}
+
+/* Returns the key that the header name starting at p refers to, or
+   NULL if the template has no such key. The end of the name is stored
+   in *endp. Sets *intoarray if the key is in an array of tables. */
+static const struct toml_key *header_key(const struct toml_key *tab,
+                                         const char *p, const char *end,
+                                         const char **endp, bool *intoarray) {
+  const struct toml_key *k = NULL;
+
+  *intoarray = false;
+  for (;;) {
+    const char *name;
+    size_t n;
+
+    while (p < end && inclass(*p, C_SPACE))
+      p++;
+    if (p < end && (*p == '"' || *p == '\'')) {
+      int q = *p++;
+      for (name = p; p < end && *p != q && *p != '\n'; p++)
+        ;
+      n = p - name;
+      p++;
+    } else {
+      for (name = p; p < end && inclass(*p, C_BARE); p++)
+        ;
+      n = p - name;
+    }
+    if (tab == NULL)
+      return NULL;
+    for (k = tab; k->name != NULL; k++) {
+      if (strncmp(k->name, name, n) == 0 && k->name[n] == '\0')
+        break;
+    }
+    if (k->name == NULL)
+      return NULL;
+    while (p < end && inclass(*p, C_SPACE))
+      p++;
+    if (p == end || *p != '.')
+      break;
+    p++;
+    if (k->type == toml_table_t)
+      tab = k->u.table;
+    else if (k->type == toml_array_t && k->u.array.type == toml_table_t) {
+      tab = k->u.array.u.tables.subtype;
+      *intoarray = true;
+    } else
+      tab = NULL;
+  }
+  *endp = p;
+  return k;
+}
+
+/* Returns the '[' that starts the header on the line at p, or NULL if
+   the line is not a header. */
+static const char *header(const char *p, const char *end) {
+  while (p < end && inclass(*p, C_SPACE))
+    p++;
+  return p < end && *p == '[' ? p : NULL;
+}
+
+/* Accounts for the header at q, on line lineno, in sp: counts the
+   elements of arrays of tables and checks that tables are not defined
+   more than once. Returns the end of the header name. */
+static const char *count_header(struct split *sp, const char *q,
+                                const char *end, int lineno) {
+  bool isarray = q + 1 < end && q[1] == '[';
+  bool intoarray;
+  const struct toml_key *k;
+
+  k = header_key(sp->template, q + 1 + isarray, end, &q, &intoarray);
+  if (k != NULL && isarray && k->type == toml_array_t) {
+    int i;
+
+    for (i = 0; i < sp->ntablearrays; i++) {
+      if (sp->tablearrays[i] == k)
+        break;
+    }
+    if (i == sp->ntablearrays) {
+      if (i == MAXTABLEARRAYS)
+        error_printf("too many arrays of tables");
+      sp->tablearrays[sp->ntablearrays++] = k;
+      sp->counts[i] = 0;
+    }
+    sp->counts[i]++;
+  } else if (k != NULL && !isarray && !intoarray) {
+    /* tables may not be defined more than once */
+    for (int i = 0; i < sp->ntables; i++) {
+      if (sp->tables[i] == k) {
+        token.lineno = lineno;
+        error_printf("table '%s' defined more than once", k->name);
+      }
+    }
+    if (sp->ntables == MAXTABLES)
+      error_printf("too many tables");
+    sp->tables[sp->ntables++] = k;
+  }
+  return q;
+}
+
+/* Starts a new section of sp at p, on line lineno. */
+static void start_section(struct split *sp, struct section *sec,
+                          const char *p, int lineno) {
+  sec->split = sp;
+  sec->start = p;
+  sec->lineno = lineno;
+  memcpy(sec->counts, sp->counts, sizeof(sec->counts));
+}
+
+/* Splits the len bytes of buf into at most n sections of about the
+   same size, at top-level headers, and counts the elements of the
+   arrays of tables that each section starts from. */
+static void split(struct split *sp, const char *buf, size_t len, int n) {
+  const char *p = buf, *end = buf + len;
+  size_t target = len / n;
+  int lineno = 1, depth = 0;
+  struct section *sec = &sp->sections[0];
+
+  sp->ntablearrays = sp->ntables = 0;
+  memset(sp->counts, 0, sizeof(sp->counts));
+  sp->nsections = 1;
+  start_section(sp, sec, buf, 1);
+  while (p < end) {
+    const char *q = depth == 0 ? header(p, end) : NULL;
+
+    if (q != NULL) {
+      if ((size_t) (p - buf) >= target * sp->nsections &&
+          sp->nsections < n) {
+        sec->len = p - sec->start;
+        sec = &sp->sections[sp->nsections++];
+        start_section(sp, sec, p, lineno);
+      }
+      p = count_header(sp, q, end, lineno);
+    }
+    p = next_line(p, end, &lineno, &depth);
+  }
+  sec->len = end - sec->start;
+}
+
+/* Parses a section on the calling thread. */
+static void *parse_section(void *arg) {
+  struct section *sec = arg;
+
+  read_memory(sec->start, sec->len);
+  inbuf = sec->split->buf;
+  tape = NULL;
+  tracering = sec->split->trace;
+  section = sec;
+  parse(sec->split->template, sec->lineno);
+  section = NULL;
+  read_done();
+  return NULL;
+}
+
+/* Points *p, if it points into the buffer at from, to the same place
+   in the shadow buffer. */
+static void rebase(const char **p, const char *from, size_t size) {
+  if (*p >= from && *p < from + size)
+    *p = reloc.lo + reloc.delta + (*p - from);
+}
+
+/* Points the strings the keys of tab left in the storage, which was
+   copied from the buffer at from, to their copies in the shadow
+   buffer: those of string and variant arrays, of views, and wherever
+   data points. Keys of the elements of an array of tables are offsets
+   from curbase. */
+static void rebase_strings(const struct toml_key *tab, const char *from,
+                           size_t size) {
+  for (const struct toml_key *k = tab; k->name != NULL; k++) {
+    if (k->data != NULL)
+      rebase(relocate(k->data), from, size);
+    if (k->type == toml_table_t) {
+      rebase_strings(k->u.table, from, size);
+    } else if (k->type == toml_strview_t) {
+      struct toml_strview *v = (struct toml_strview *) target_address(k);
+
+      if (v != NULL)
+        rebase(&v->ptr, from, size);
+    } else if (k->type == toml_array_t) {
+      const struct toml_array a = relocate_array(&k->u.array);
+      char *savedbase = curbase;
+      int n;
+
+      if (a.count == NULL)
+        continue;
+      /* the elements past len are in storage from the allocator */
+      n = (size_t) *a.count < a.len ? *a.count : (int) a.len;
+      for (int i = 0; i < n; i++) {
+        switch (a.type) {
+        case toml_string_t:
+          rebase((const char **) &a.u.strings.ptrs[i], from, size);
+          break;
+        case toml_variant_t:
+          if (a.u.variants.elems[i].type == toml_string_t)
+            rebase(&a.u.variants.elems[i].u.string, from, size);
+          break;
+        case toml_table_t:
+          curbase = table_address(&a, i);
+          rebase_strings(a.u.tables.subtype, from, size);
+          curbase = savedbase;
+          break;
+        default:
+          break;
+        }
+      }
+    }
+  }
+}
+
+int toml_reload(struct toml_reload *r, FILE *f) {
+  int cur = __atomic_load_n(&r->current, __ATOMIC_SEQ_CST), next = !cur;
+  char *base = r->buf[0], *shadow = r->buf[next];
+  jmp_buf env;
+  int errnum;
+
+  /* Wait for the readers of the epoch that last published the shadow
+     to finish with it. New readers only take the current buffer. */
+  while (__atomic_load_n(&r->readers[next], __ATOMIC_SEQ_CST) != 0)
+    sched_yield();
+
+  memcpy(shadow, r->buf[cur], r->size);
+  reloc.lo = base;
+  reloc.hi = base + r->size;
+  reloc.delta = shadow - base;
+  curbase = NULL;
+  rebase_strings(r->keys, r->buf[cur], r->size);
+  if ((errnum = setjmp(env)) == 0) {
+    errjmp = &env;
+    errnum = toml_unmarshal(f, r->keys);
+  }
+  errjmp = NULL;
+  read_done(); /* a failed parse left its window */
+  lex_sink(NULL, 0, false);
+  reloc.lo = reloc.hi = NULL;
+  reloc.delta = 0;
+  if (errnum == 0) /* publish */
+    __atomic_store_n(&r->current, next, __ATOMIC_SEQ_CST);
+  return errnum;
+}
+
+const void *toml_read_lock(struct toml_reload *r) {
+  for (;;) {
+    int i = __atomic_load_n(&r->current, __ATOMIC_SEQ_CST);
+
+    __atomic_add_fetch(&r->readers[i], 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&r->current, __ATOMIC_SEQ_CST) == i)
+      return r->buf[i];
+    /* a reload published meanwhile, and may be writing to buf[i] */
+    __atomic_sub_fetch(&r->readers[i], 1, __ATOMIC_SEQ_CST);
+  }
+}
+
+void toml_read_unlock(struct toml_reload *r, const void *p) {
+  __atomic_sub_fetch(&r->readers[p == r->buf[1]], 1, __ATOMIC_SEQ_CST);
+}
+
+int toml_unmarshal_parallel(const char *buf, size_t len,
+                            const struct toml_key *template, int nthreads) {
+  struct split sp;
+  pthread_t threads[MAXSECTIONS];
+  int err;
+
+  if (nthreads < 1)
+    nthreads = 1;
+  else if (nthreads > MAXSECTIONS)
+    nthreads = MAXSECTIONS;
+  sp.template = template;
+  sp.buf = buf;
+  sp.trace = tracering;
+  token.lineno = 1;
+  split(&sp, buf, len, nthreads);
+
+  reset_counts(template);
+  for (int i = 1; i < sp.nsections; i++) {
+    err = pthread_create(&threads[i], NULL, parse_section, &sp.sections[i]);
+    if (err != 0) {
+      fprintf(stderr, "pthread_create: %s\n", strerror(err));
+      exit(2);
+    }
+  }
+  parse_section(&sp.sections[0]);
+  for (int i = 1; i < sp.nsections; i++)
+    pthread_join(threads[i], NULL);
+
+  for (int i = 0; i < sp.ntablearrays; i++)
+    *table_count(sp.tablearrays[i]) = sp.counts[i];
+  return 0;
+}
+
+/* Returns the 64-bit FNV-1a hash of the section sec, including the
+   element counts it starts from, which determine where its arrays of
+   tables are stored. */
+static unsigned long long hash_section(const struct section *sec) {
+  unsigned long long h = 14695981039346656037ULL;
+  const unsigned char *p = (const unsigned char *) sec->start;
+
+  for (size_t i = 0; i < sec->len; i++) {
+    h ^= p[i];
+    h *= 1099511628211ULL;
+  }
+  for (int i = 0; i < sec->split->ntablearrays; i++) {
+    h ^= (unsigned) sec->counts[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+/* Parses the section sec, the nth of its document, unless idx shows it
+   unchanged since the previous revision. */
+static void reparse_section(struct section *sec, size_t n,
+                            struct toml_index *idx) {
+  unsigned long long h = hash_section(sec);
+
+  if (n < idx->count && idx->hashes[n] == h)
+    return;
+  parse_section(sec);
+  if (n < idx->len)
+    idx->hashes[n] = h;
+}
+
+/* Tells whether every toml_strview key of tab has storage to be copied
+   to. */
+static bool views_stored(const struct toml_key *tab) {
+  for (const struct toml_key *k = tab; k->name != NULL; k++) {
+    if (k->type == toml_table_t && !views_stored(k->u.table))
+      return false;
+    if (k->type == toml_array_t && k->u.array.type == toml_table_t &&
+        !views_stored(k->u.array.u.tables.subtype))
+      return false;
+    if (k->type == toml_strview_t &&
+        (k->u.strview.store == NULL || k->size == 0))
+      return false;
+  }
+  return true;
+}
+
+int toml_unmarshal_incremental(const char *buf, size_t len,
+                               const struct toml_key *template,
+                               struct toml_index *idx) {
+  const char *p = buf, *end = buf + len;
+  struct split sp;
+  struct section sec;
+  size_t n = 0;
+  int lineno = 1, depth = 0;
+
+  /* the views of the sections not parsed again would be left in the
+     buffer of the previous revision */
+  if (!views_stored(template)) {
+    errno = EINVAL;
+    return -1;
+  }
+  copyviews = true;
+  sp.template = template;
+  sp.buf = buf;
+  sp.trace = tracering;
+  sp.ntablearrays = sp.ntables = 0;
+  memset(sp.counts, 0, sizeof(sp.counts));
+  token.lineno = 1;
+  start_section(&sp, &sec, buf, 1);
+  while (p < end) {
+    const char *q = depth == 0 ? header(p, end) : NULL;
+
+    if (q != NULL) {
+      if (p != buf) {
+        sec.len = p - sec.start;
+        reparse_section(&sec, n++, idx);
+        start_section(&sp, &sec, p, lineno);
+      }
+      p = count_header(&sp, q, end, lineno);
+    }
+    p = next_line(p, end, &lineno, &depth);
+  }
+  sec.len = end - sec.start;
+  reparse_section(&sec, n++, idx);
+  copyviews = false;
+  /* without a hash for every section, the next parse must be full */
+  idx->count = n <= idx->len ? n : 0;
+
+  reset_counts(template);
+  for (int i = 0; i < sp.ntablearrays; i++)
+    *table_count(sp.tablearrays[i]) = sp.counts[i];
+  return 0;
+}
+
+void toml_feed_start(struct toml_feed *f, const char *buf,
+                     const struct toml_key *template, void *base) {
+  memset(f, 0, sizeof(*f));
+  f->keys = template;
+  f->base = base;
+  f->buf = buf;
+  f->lineno = f->startline = 1;
+}
+
+/* Scans the lines of the len bytes of f that have arrived whole, or all
+   of them if the document has ended, and parses the sections that end
+   among them. sp holds the headers of f while it does. */
+static void feed_lines(struct toml_feed *f, struct split *sp, size_t len,
+                       bool ended) {
+  const char *p = f->buf + f->scanned, *end = f->buf + len;
+  struct section sec;
+
+  start_section(sp, &sec, f->buf + f->start, f->startline);
+  memcpy(sec.counts, f->startcounts, sizeof(sec.counts));
+  while (p < end) {
+    int lineno = f->lineno, depth = f->depth;
+    const char *next = next_line(p, end, &lineno, &depth);
+    const char *q = f->depth == 0 ? header(p, next) : NULL;
+
+    if (next == end && !ended)
+      break; /* the line, or a string in it, may go on */
+    if (q != NULL) {
+      if (p != sec.start) {
+        sec.len = p - sec.start;
+        parse_section(&sec);
+        start_section(sp, &sec, p, f->lineno);
+      }
+      token.lineno = f->lineno;
+      count_header(sp, q, next, f->lineno);
+    }
+    p = next;
+    f->lineno = lineno;
+    f->depth = depth;
+  }
+  f->scanned = p - f->buf;
+  f->start = sec.start - f->buf;
+  f->startline = sec.lineno;
+  memcpy(f->startcounts, sec.counts, sizeof(f->startcounts));
+  if (ended) {
+    sec.len = end - sec.start;
+    parse_section(&sec);
+    reset_counts(sp->template);
+    for (int i = 0; i < sp->ntablearrays; i++)
+      *table_count(sp->tablearrays[i]) = sp->counts[i];
+  }
+}
+
+/* Parses what has arrived of f, with the headers of f in a split. */
+static int feed(struct toml_feed *f, size_t len, bool ended) {
+  struct split sp;
+  jmp_buf env;
+  int errnum;
+
+  if (f->error != 0)
+    return f->error;
+  sp.template = f->keys;
+  sp.buf = f->buf;
+  sp.trace = tracering;
+  memcpy(sp.tablearrays, f->tablearrays, sizeof(sp.tablearrays));
+  memcpy(sp.counts, f->counts, sizeof(sp.counts));
+  sp.ntablearrays = f->ntablearrays;
+  memcpy(sp.tables, f->tables, sizeof(sp.tables));
+  sp.ntables = f->ntables;
+  rootbase = f->base;
+  if ((errnum = setjmp(env)) == 0) {
+    errjmp = &env;
+    feed_lines(f, &sp, len, ended);
+  }
+  errjmp = NULL;
+  section = NULL;
+  rootbase = NULL;
+  read_done(); /* a failed parse left its window */
+  lex_sink(NULL, 0, false);
+  memcpy(f->tablearrays, sp.tablearrays, sizeof(f->tablearrays));
+  memcpy(f->counts, sp.counts, sizeof(f->counts));
+  f->ntablearrays = sp.ntablearrays;
+  memcpy(f->tables, sp.tables, sizeof(f->tables));
+  f->ntables = sp.ntables;
+  f->error = errnum;
+  return errnum;
+}
+
+int toml_feed(struct toml_feed *f, size_t len) {
+  return feed(f, len, false);
+}
+
+int toml_feed_end(struct toml_feed *f, size_t len) {
+  return feed(f, len, true);
+}
+
+enum {
+  JSONBUFSIZE = 1 << 16, /* the output buffer, and the string buffer */
+};
+
+/* A table of a document converted by toml_to_json: its keys, by where
+   they are in the input, and its subtables. The tables of an array of
+   tables are its elements, and have no name. */
+struct jtable {
+  const char *name;
+  bool array;   /* an array of tables */
+  bool defined; /* by a [ header ] */
+  struct jkey *keys, *lastkey;
+  struct jtable *tables, *lasttable;
+  struct jtable *next; /* the next table of the parent */
+};
+
+/* A run of key-value pairs of a table, from the last part of the key
+   of the first to the end of the line of the last. */
+struct jkey {
+  const char *at, *end;
+  int lineno;
+  struct jkey *next;
+};
+
+/* The JSON being written, through a buffer, and the scratch the tables
+   are indexed in. */
+static _Thread_local struct {
+  FILE *f;
+  char *buf, *p, *end;
+  bool failed;
+  char *strings; /* for strings with escapes, JSONBUFSIZE bytes */
+  char *scratch, *scratchend;
+  struct jkey *run; /* the pairs just indexed, which the next may extend */
+} json;
+
+static _Thread_local char jsonbuf[JSONBUFSIZE], jsonstrings[JSONBUFSIZE];
+
+/* Returns n bytes of the scratch, or fails. */
+static void *json_alloc(size_t n) {
+  size_t align = _Alignof(max_align_t);
+  char *p = (char *) (((uintptr_t) json.scratch + align - 1) & -align);
+
+  if (p > json.scratchend || (size_t) (json.scratchend - p) < n)
+    error_printf("out of scratch");
+  json.scratch = p + n;
+  return memset(p, 0, n);
+}
+
+/* Writes out what is in the buffer. */
+static void json_flush(void) {
+  size_t n = json.p - json.buf;
+
+  if (n > 0 && !json.failed && fwrite(json.buf, 1, n, json.f) != n)
+    json.failed = true;
+  json.p = json.buf;
+}
+
+/* Appends the n bytes at s to the output. */
+static void json_put(const char *s, size_t n) {
+  if ((size_t) (json.end - json.p) < n) {
+    json_flush();
+    if (n > JSONBUFSIZE) {
+      if (!json.failed && fwrite(s, 1, n, json.f) != n)
+        json.failed = true;
+      return;
+    }
+  }
+  memcpy(json.p, s, n);
+  json.p += n;
+}
+
+static void json_putc(int c) {
+  if (json.p == json.end)
+    json_flush();
+  *json.p++ = c;
+}
+
+/* Appends the n bytes of UTF-8 at s as a JSON string. Runs of bytes
+   that need no escape are copied at once. */
+static void json_string(const char *s, size_t n) {
+  static const char hex[] = "0123456789abcdef";
+  const char *end = s + n, *run = s;
+
+  json_putc('"');
+  for (; s < end; s++) {
+    unsigned char c = *s;
+    char esc[6] = {'\\', 0, '0', '0', 0, 0};
+
+    if (c >= 0x20 && c != '"' && c != '\\')
+      continue;
+    json_put(run, s - run);
+    run = s + 1;
+    switch (c) {
+    case '"':
+    case '\\':
+      esc[1] = c;
+      break;
+    case '\b':
+      esc[1] = 'b';
+      break;
+    case '\f':
+      esc[1] = 'f';
+      break;
+    case '\n':
+      esc[1] = 'n';
+      break;
+    case '\r':
+      esc[1] = 'r';
+      break;
+    case '\t':
+      esc[1] = 't';
+      break;
+    default:
+      esc[1] = 'u';
+      esc[4] = hex[c >> 4];
+      esc[5] = hex[c & 0xf];
+      json_put(esc, 6);
+      continue;
+    }
+    json_put(esc, 2);
+  }
+  json_put(run, s - run);
+  json_putc('"');
+}
+
+/* Returns the next token. Strings are left in the input unless they
+   have escapes, and are not '\0'-terminated. */
+static int json_next(void) {
+  lex_view(json.strings, JSONBUFSIZE);
+  sink.strict = true;
+  return lex_next();
+}
+
+/* Returns the subtable of t named by the current token, adding it if
+   it is not there. Subtables are looked for in the last element of an
+   array of tables. */
+static struct jtable *json_subtable(struct jtable *t) {
+  struct jtable *sub;
+  char *name;
+
+  if (t->array)
+    t = t->lasttable;
+  for (sub = t->tables; sub != NULL; sub = sub->next) {
+    if (strncmp(sub->name, token.text, token.len) == 0 &&
+        sub->name[token.len] == '\0')
+      return sub;
+  }
+  name = json_alloc(token.len + 1);
+  memcpy(name, token.text, token.len);
+  sub = json_alloc(sizeof(*sub));
+  sub->name = name;
+  if (t->lasttable != NULL)
+    t->lasttable->next = sub;
+  else
+    t->tables = sub;
+  return t->lasttable = sub;
+}
+
+/* Indexes the [ table ] or [[ array ]] header that starts with the
+   current token, and returns the table its keys go to. */
+static struct jtable *json_header(struct jtable *root) {
+  bool isarray = token.type == LBRACKETS;
+  struct jtable *t = root, *elem;
+
+  for (;;) {
+    if (json_next() != BARE_KEY && token.type != STRING)
+      error_printf("key was expected");
+    t = json_subtable(t);
+    if (json_next() != '.')
+      break;
+  }
+  if (token.type != (isarray ? RBRACKETS : ']'))
+    error_printf(isarray ? "missing ']]'" : "missing ']'");
+  if (!isarray) {
+    if (t->array || t->defined)
+      error_printf("table '%s' defined more than once", t->name);
+    t->defined = true;
+  } else {
+    if (t->tables != NULL && !t->array)
+      error_printf("'%s' is not an array of tables", t->name);
+    t->array = true;
+    elem = json_alloc(sizeof(*elem));
+    if (t->lasttable != NULL)
+      t->lasttable->next = elem;
+    else
+      t->tables = elem;
+    t = t->lasttable = elem;
+  }
+  if (json_next() != NEWLINE && token.type != EOF)
+    error_printf("expected newline");
+  json.run = NULL;
+  return t;
+}
+
+/* Indexes the key-value pair that starts with the current token, at
+   line in the input, in the table t, and skips its value. Pairs that
+   follow each other in a table are indexed as one run. */
+static void json_keyval(struct jtable *t, const char *line) {
+  const char *at = line, *end = (const char *) inend, *p;
+  int lineno = token.lineno, depth = 0;
+  struct jkey *k;
+
+  while (json_next() == '.') {
+    t = json_subtable(t);
+    at = (const char *) inp;
+    if (json_next() != BARE_KEY && token.type != STRING)
+      error_printf("expected dotted key");
+  }
+  if (token.type != '=')
+    error_printf("missing '='");
+  if (t->array)
+    t = t->lasttable;
+  /* the value is scanned when it is written */
+  p = (const char *) inp;
+  do
+    p = next_line(p, end, &token.lineno, &depth);
+  while (depth > 0 && p < end);
+  inp = (const unsigned char *) p;
+
+  if (at == line && json.run != NULL && json.run == t->lastkey) {
+    json.run->end = p;
+    return;
+  }
+  k = json_alloc(sizeof(*k));
+  k->at = at;
+  k->end = p;
+  k->lineno = lineno;
+  if (t->lastkey != NULL)
+    t->lastkey->next = k;
+  else
+    t->keys = k;
+  t->lastkey = k;
+  json.run = at == line ? k : NULL; /* a dotted key starts its own */
+}
+
+/* Indexes the tables and keys of the input under root. */
+static void json_index(struct jtable *root) {
+  struct jtable *t = root;
+  const char *line = (const char *) inp;
+
+  while (json_next() != EOF) {
+    if (token.type == '[' || token.type == LBRACKETS)
+      t = json_header(root);
+    else if (token.type == BARE_KEY || token.type == STRING)
+      json_keyval(t, line);
+    else if (token.type != NEWLINE)
+      error_printf("invalid token");
+    line = (const char *) inp;
+  }
+}
+
+static void json_value(void);
+
+/* Writes an integer, given in base. */
+static void json_integer(const char *s, int base) {
+  char digits[72], *p = digits, *endptr;
+  char out[32];
+  long val;
+
+  for (; *s != '\0' && p < digits + sizeof(digits) - 1; s++) {
+    if (*s != '_')
+      *p++ = *s;
+  }
+  *p = '\0';
+  errno = 0;
+  val = strtol(digits, &endptr, base);
+  if (errno != 0 || endptr == digits || *endptr != '\0')
+    error_printf("invalid integer");
+  json_put(out, snprintf(out, sizeof(out), "%ld", val));
+}
+
+/* Writes the array, whose '[' is the current token. */
+static void json_array(void) {
+  bool first = true;
+
+  json_putc('[');
+  for (;;) {
+    while (json_next() == NEWLINE)
+      ;
+    if (token.type == RBRACKETS)
+      split_brackets();
+    if (token.type == ']')
+      break;
+    if (!first) {
+      if (token.type != ',')
+        error_printf("expected ',' or ']'");
+      while (json_next() == NEWLINE)
+        ;
+      if (token.type == RBRACKETS)
+        split_brackets();
+      if (token.type == ']') /* a trailing comma */
+        break;
+      json_putc(',');
+    }
+    json_value();
+    first = false;
+  }
+  json_putc(']');
+}
+
+/* Writes the inline table, whose '{' is the current token. */
+static void json_inline_table(void) {
+  json_putc('{');
+  if (json_next() != '}') {
+    for (;;) {
+      if (token.type != BARE_KEY && token.type != STRING)
+        error_printf("expected key");
+      json_string(token.text, token.len);
+      json_putc(':');
+      if (json_next() == '.')
+        error_printf("dotted keys in inline tables are not supported");
+      if (token.type != '=')
+        error_printf("missing '='");
+      json_next();
+      json_value();
+      if (json_next() != ',')
+        break;
+      json_putc(',');
+      json_next();
+    }
+    if (token.type != '}')
+      error_printf("expected '}'");
+  }
+  json_putc('}');
+}
+
+/* Writes the value that starts with the current token. */
+static void json_value(void) {
+  const char *s = token.text;
+  char *endptr;
+
+  switch (token.type) {
+  case STRING:
+    json_string(token.text, token.len);
+    break;
+  case INTEGER:
+    json_integer(s + (*s == '+'), 10);
+    break;
+  case HEX_INTEGER:
+    json_integer(s + 2, 16);
+    break;
+  case OCT_INTEGER:
+    json_integer(s + 2, 8);
+    break;
+  case BIN_INTEGER:
+    json_integer(s + 2, 2);
+    break;
+  case FLOAT:
+    s += *s == '+';
+    if (strcmp(s, "inf") == 0 || strcmp(s, "-inf") == 0 ||
+        strcmp(s, "nan") == 0 || strcmp(s, "-nan") == 0) {
+      json_string(s, strlen(s));
+      break;
+    }
+    errno = 0;
+    strtod(s, &endptr);
+    if (errno != 0 || endptr == s || *endptr != '\0' || endptr[-1] == '.')
+      error_printf("invalid float");
+    json_put(s, endptr - s);
+    break;
+  case BARE_KEY:
+    if (strcmp(s, "true") == 0 || strcmp(s, "false") == 0)
+      json_put(s, token.len);
+    else if (strcmp(s, "inf") == 0 || strcmp(s, "nan") == 0)
+      json_string(s, token.len);
+    else
+      error_printf("invalid value '%s'", s);
+    break;
+  case LBRACKETS: /* an array of arrays */
+    split_brackets();
+    /* fall through */
+  case '[':
+    json_array();
+    break;
+  case '{':
+    json_inline_table();
+    break;
+  default:
+    error_printf("value was expected");
+  }
+}
+
+/* Writes the key-value pairs of the run k, after a ',' unless they
+   are the first of their table. */
+static void json_pairs(const struct jkey *k, bool *first) {
+  inp = (const unsigned char *) k->at;
+  token.lineno = k->lineno;
+  while ((const char *) inp < k->end) {
+    if (json_next() == NEWLINE)
+      continue;
+    if (!*first)
+      json_putc(',');
+    *first = false;
+    json_string(token.text, token.len);
+    json_putc(':');
+    json_next(); /* '=', as indexed */
+    json_next();
+    json_value();
+    if (json_next() != NEWLINE && token.type != EOF)
+      error_printf("expected newline");
+  }
+}
+
+/* Writes the table t, its keys first and then its subtables. */
+static void json_table(const struct jtable *t) {
+  bool first = true;
+
+  json_putc('{');
+  for (const struct jkey *k = t->keys; k != NULL; k = k->next)
+    json_pairs(k, &first);
+  for (const struct jtable *sub = t->tables; sub != NULL; sub = sub->next) {
+    if (!first)
+      json_putc(',');
+    json_string(sub->name, strlen(sub->name));
+    json_putc(':');
+    if (sub->array) {
+      json_putc('[');
+      for (const struct jtable *e = sub->tables; e != NULL; e = e->next) {
+        if (e != sub->tables)
+          json_putc(',');
+        json_table(e);
+      }
+      json_putc(']');
+    } else
+      json_table(sub);
+    first = false;
+  }
+  json_putc('}');
+}
+
+int toml_to_json(const char *buf, size_t len, FILE *out, void *scratch,
+                 size_t size) {
+  struct jtable *root;
+  jmp_buf env;
+  int errnum;
+
+  json.f = out;
+  json.buf = json.p = jsonbuf;
+  json.end = jsonbuf + sizeof(jsonbuf);
+  json.failed = false;
+  json.strings = jsonstrings;
+  json.scratch = scratch;
+  json.scratchend = json.scratch + size;
+  json.run = NULL;
+  tape = NULL;
+  section = NULL;
+  cursor = NULL;
+  pending = 0;
+  if ((errnum = setjmp(env)) == 0) {
+    errjmp = &env;
+    root = json_alloc(sizeof(*root));
+    read_memory(buf, len);
+    token.lineno = 1;
+    json_index(root);
+    read_memory(buf, len);
+    json_table(root);
+    json_putc('\n');
+  }
+  errjmp = NULL;
+  read_done();
+  lex_sink(NULL, 0, false);
+  if (errnum != 0)
+    return errnum;
+  json_flush();
+  if (json.failed || fflush(out) != 0)
+    return -1;
+  return 0;
+}
+
+void toml_trace(struct toml_trace *t) { tracering = t; }
+
+static const char tracemagic[8] = "TOMLTRC1";
+
+int toml_trace_write(const struct toml_trace *t, FILE *f) {
+  unsigned long count = __atomic_load_n(&t->count, __ATOMIC_ACQUIRE);
+  unsigned long i = count > t->len ? count - t->len : 0;
+
+  if (fwrite(tracemagic, sizeof(tracemagic), 1, f) != 1)
+    return -1;
+  for (; i < count; i++) {
+    const struct toml_trace_record *r = &t->records[i & (t->len - 1)];
+
+    if (fwrite(r, sizeof(*r), 1, f) != 1)
+      return -1;
+  }
+  return fflush(f) == 0 ? 0 : -1;
+}
+
+int toml_trace_read(struct toml_trace *t, FILE *f) {
+  char magic[sizeof(tracemagic)];
+  struct toml_trace_record r;
+
+  if (fread(magic, sizeof(magic), 1, f) != 1 ||
+      memcmp(magic, tracemagic, sizeof(magic)) != 0)
+    return -1;
+  while (fread(&r, sizeof(r), 1, f) == 1)
+    t->records[t->count++ & (t->len - 1)] = r;
+  return ferror(f) ? -1 : 0;
+}
+
+const char *toml_event_name(int event) {
+  static const char *const names[TOML_NEVENTS] = {
+      [toml_parse_event] = "parse",
+      [toml_done_event] = "done",
+      [toml_table_event] = "table",
+      [toml_value_event] = "value",
+      [toml_type_event] = "type",
+      [toml_number_event] = "number",
+      [toml_boolean_event] = "boolean",
+      [toml_array_full_event] = "array_full",
+      [toml_strings_full_event] = "strings_full",
+      [toml_depth_event] = "depth",
+      [toml_unknown_key_event] = "unknown_key",
+      [toml_syntax_event] = "syntax",
+  };
+
+  if (event < 0 || event >= TOML_NEVENTS)
+    return "?";
+  return names[event];
+}
+
+const struct toml_error *toml_last_error(void) { return &lasterror; }
+
 const char *toml_strerror(int errnum) {
   (void) errnum;
   return "there was an error";
@@ -5,6 +5,10 @@
 #include <stddef.h> /* offsetof(3) */
 #include <stdio.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /* The different types of the key values. */
 enum toml_type {
   toml_short_t,
@@ -18,12 +22,39 @@ enum toml_type {
   toml_string_t,
   toml_array_t,
   toml_table_t,
-  toml_time_t
+  toml_time_t,
+  toml_strview_t,
+  toml_variant_t
+};
+
+/* A string as a slice of the input. See toml_strview_t. */
+struct toml_strview {
+  const char *ptr;
+  size_t len;
+};
+
+/* An element of an array of type toml_variant_t, whose elements may
+   be of any type: toml_long_t, toml_float_t, toml_bool_t, toml_string_t,
+   or toml_array_t. The elements of a nested array follow it. */
+struct toml_variant {
+  enum toml_type type;
+  union {
+    long integer;
+    double real;
+    bool boolean;
+    const char *string;
+    struct {
+      /* The number of elements of the array, and of the variants
+         after it that make them up, its nested arrays included. */
+      int count;
+      int size;
+    } array;
+  } u;
 };
 
 /* The representation of an array value. All elements of the
-   array must be of the same type. Arrays may not be array
-   elements. */
+   array must be of the same type, unless it is toml_variant_t.
+   Nested arrays are stored flat, one after the other. */
 struct toml_array {
   /* The type of the values of the array. */
   enum toml_type type;
@@ -31,6 +62,11 @@ struct toml_array {
   int *count;
   /* The maximum capacity of the array.*/
   size_t len;
+  /* For the arrays of other arrays, as matrices, which must be of the
+     same length at each depth: the length at each depth, for up to
+     rank depths. Unused depths are 0. */
+  int *shape;
+  int rank;
 
   union {
     double *real;
@@ -45,6 +81,12 @@ struct toml_array {
       char *store;
       int storelen;
     } strings;
+    /* the strings go to the store */
+    struct {
+      struct toml_variant *elems;
+      char *store;
+      int storelen;
+    } variants;
     union {
       short *s;
       unsigned short *us;
@@ -56,6 +98,16 @@ struct toml_array {
   } u;
 };
 
+/* An allocator for the strings and arrays that outgrow the storage of
+   their template. alloc returns size bytes, or NULL. free, if set, is
+   given back the blocks that were outgrown in turn; the blocks in use
+   at the end of a parse are the caller's. */
+struct toml_allocator {
+  void *(*alloc)(void *ctx, size_t size);
+  void (*free)(void *ctx, void *p, size_t size);
+  void *ctx;
+};
+
 /* The representation of a key/value pair. */
 struct toml_key {
   /* The name of the key. */
@@ -66,6 +118,13 @@ struct toml_key {
   union {
     /* TOML_TYPE_STRING */
     char *string;
+    /* TOML_TYPE_STRVIEW: when the input is in memory, strings without
+       escapes are left there; the rest are stored, '\0'-terminated, in
+       the size bytes at store. */
+    struct {
+      struct toml_strview *view;
+      char *store;
+    } strview;
     /* TOML_TYPE_FLOAT */
     double *real;
     /* TOML_TYPE_BOOL */
@@ -89,18 +148,470 @@ struct toml_key {
     /* TOML_TYPE_ARRAY */
     const struct toml_array array;
     size_t offset;
+    /* The {NULL} key that ends a table */
+    const struct toml_hash *hash;
   } u;
-  /* The size of the array of characters pointed to by string. */
+  /* The size of the array of characters pointed to by string.
+     Longer strings are truncated. */
   size_t size;
+  /* Whether a parse of a compiled template fails without the key. */
+  bool required;
+  /* If alloc is set, a string or an array that does not fit in its
+     storage is moved to storage from alloc, growing geometrically,
+     and the address of wherever it is is stored at data: the elements
+     of an array, or the string. */
+  const struct toml_allocator *alloc;
+  void **data;
+  /* The default value, stored by toml_compile. */
+  union {
+    long integer;
+    double real;
+    bool boolean;
+    const char *string;
+  } dflt;
+};
+
+/* A perfect hash of the names of the keys of a table, which the {NULL}
+   key that ends the table may refer to, so that keys are looked up
+   without comparing every name. With h(s, name) the 32-bit FNV-1a hash
+   of name with s xored into its offset basis, then mixed by the fmix32
+   finalizer of MurmurHash3, the key named name is the
+   (slots[h(seeds[h(0, name) & bmask], name) & mask] - 1)th of the
+   table; 0 is an empty slot. toml.hpp generates them for C++. */
+struct toml_hash {
+  unsigned int mask, bmask;
+  const unsigned int *seeds;
+  const unsigned short *slots;
 };
 
 /* toml_unmarshal parses the TOML-encoded data of f and stores
    the result into static locations specified in the template
-   structure refered to by template. */
-int toml_unmarshal(FILE *f, const struct toml_key *template);
+   structure refered to by keys. */
+int toml_unmarshal(FILE *f, const struct toml_key *keys);
+
+/* toml_unmarshal_fd is like toml_unmarshal, but reads the file
+   descriptor fd, which may be a pipe or a socket, up to its end. */
+int toml_unmarshal_fd(int fd, const struct toml_key *keys);
+
+/* toml_unmarshal_base is like toml_unmarshal, but parses the len bytes
+   at buf, and the keys of the template are offsets from base, as those
+   of the elements of an array of tables are. */
+int toml_unmarshal_base(const char *buf, size_t len,
+                        const struct toml_key *keys, void *base);
+
+/* The maximum length of a lexeme in a tokenized document. */
+#define TOML_TOKEN_MAXLEN (1u << 24)
+
+/* A token of a tokenized document. Its lexeme, if any, is stored
+   '\0'-terminated at offset in the store of the tape. */
+struct toml_token {
+  unsigned int type : 8;
+  unsigned int len : 24;
+  unsigned int offset;
+};
+
+/* The representation of a tokenized document. Lexing is done once by
+   toml_tokenize, and the tape can then be unmarshaled any number of
+   times, with different templates, without reading the input again. */
+struct toml_tape {
+  /* The tokens, and the maximum number of them. */
+  struct toml_token *tokens;
+  size_t len;
+  /* The number of tokens stored. */
+  size_t count;
+  /* The storage for the lexemes, and its size. */
+  char *store;
+  size_t storelen;
+};
+
+/* toml_tokenize lexes the TOML-encoded data of f into the tape t. */
+int toml_tokenize(FILE *f, struct toml_tape *t);
+
+/* toml_unmarshal_tape is like toml_unmarshal, but runs the grammar
+   over the tokens of t instead of scanning an input. */
+int toml_unmarshal_tape(const struct toml_tape *t,
+                        const struct toml_key *keys);
+
+/* toml_unmarshal_parallel is like toml_unmarshal, but parses the len
+   bytes at buf. The document is split at its top-level [ table ] and
+   [[ array ]] headers into at most nthreads sections, which are parsed
+   concurrently. A table may not be defined more than once. */
+int toml_unmarshal_parallel(const char *buf, size_t len,
+                            const struct toml_key *keys, int nthreads);
+
+/* The hashes of the sections of a parsed document, one per top-level
+   [ table ] or [[ array ]] header, plus one for the lines before the
+   first. The storage is the caller's; count is 0 before the first
+   parse. */
+struct toml_index {
+  unsigned long long *hashes;
+  size_t len;
+  size_t count;
+};
+
+/* toml_unmarshal_incremental parses the len bytes at buf on the calling
+   thread, but only the sections that changed since the revision idx
+   was recorded from; the values of the others are left as they are.
+   Keys removed from a revision keep their previous values. As buf may
+   be another buffer at each revision, the strings of toml_strview keys
+   are copied to their store instead of being left in it: it fails with
+   errno EINVAL, without parsing, if one of them has no store. */
+int toml_unmarshal_incremental(const char *buf, size_t len,
+                               const struct toml_key *keys,
+                               struct toml_index *idx);
+
+/* The most arrays of tables and [ table ]s of a fed document. */
+#define TOML_FEED_MAXTABLEARRAYS 32
+#define TOML_FEED_MAXTABLES 128
+
+/* A document parsed as it arrives. Each section of it, from a top-level
+   [ table ] or [[ array ]] header up to the next, is parsed as soon as
+   the line after it has arrived, and the last one when the document
+   ends. As with toml_unmarshal_parallel, a table may not be defined
+   more than once. The storage is the caller's. */
+struct toml_feed {
+  const struct toml_key *keys; /* the template */
+  void *base;                  /* see toml_unmarshal_base */
+  const char *buf;
+  /* The first line not yet seen whole, its number, and the depth of
+     the brackets open before it. */
+  size_t scanned;
+  int lineno, depth;
+  /* The section it is in, its first line, and the number of elements
+     of each array of tables in the sections before it. */
+  size_t start;
+  int startline;
+  int startcounts[TOML_FEED_MAXTABLEARRAYS];
+  /* The headers seen so far. */
+  const struct toml_key *tablearrays[TOML_FEED_MAXTABLEARRAYS];
+  int counts[TOML_FEED_MAXTABLEARRAYS];
+  int ntablearrays;
+  const struct toml_key *tables[TOML_FEED_MAXTABLES];
+  int ntables;
+  /* The status of the first section that did not parse, or 0. */
+  int error;
+};
+
+/* toml_feed_start starts a document that arrives at buf, which must
+   hold all of it and stay where it is, as toml_strview keys refer to
+   it. The keys of the template are offsets from base, or addresses if
+   base is NULL. */
+void toml_feed_start(struct toml_feed *f, const char *buf,
+                     const struct toml_key *keys, void *base);
+
+/* toml_feed parses the sections of the first len bytes of the document
+   that have arrived whole, and toml_feed_end the rest of them. A
+   document that does not parse is not an exit, as in toml_unmarshal,
+   but a status returned by the call that parsed the section, and by
+   every call after it. */
+int toml_feed(struct toml_feed *f, size_t len);
+int toml_feed_end(struct toml_feed *f, size_t len);
+
+/* toml_to_json writes the TOML-encoded len bytes at buf to out as JSON,
+   without a template. Values are scanned once, as they are written;
+   only the tables and keys of the document are indexed, in the size
+   bytes at scratch, so that a table is written whole wherever its
+   sections and dotted keys are. Integers are written in decimal, and
+   inf and nan as strings. Keys defined twice are not detected, and
+   inline tables may not have dotted keys. A document that does not
+   parse, or does not fit the scratch, is a status returned, as by
+   toml_feed; if out cannot be written to, -1 is.
+
+   The document is read twice, once to index it and once to write it,
+   so all of it must be at buf; it is not streamed. The index takes
+   about 64 bytes for each table, and for each run of keys that are
+   not interrupted by a header or a dotted key, and a document whose
+   index does not fit the scratch fails with "out of scratch". */
+int toml_to_json(const char *buf, size_t len, FILE *out, void *scratch,
+                 size_t size);
+
+/* The state of a configuration that can be reloaded while it is being
+   read. The template refers to buf[0]; buf[1] is a shadow of the same
+   size, and each reload parses into whichever of the two is not
+   published, then publishes it. */
+struct toml_reload {
+  const struct toml_key *keys; /* the template */
+  void *buf[2];
+  size_t size;
+  /* The index of the published buffer. */
+  int current;
+  /* The number of readers of each buffer. */
+  int readers[2];
+};
+
+/* toml_reload_storage takes the storage the template refers to, and
+   an object of the same type to use as its shadow. */
+#define toml_reload_storage(v, s) .buf = {&(v), &(s)}, .size = sizeof(v)
+
+/* toml_reload parses the TOML-encoded data of f into a copy of the
+   published values of r, and publishes the copy if the parse succeeds.
+   Reloads must not run concurrently with each other, but may with any
+   number of readers. */
+int toml_reload(struct toml_reload *r, FILE *f);
+
+/* toml_read_lock returns the published values of r, which stay valid
+   until they are passed back to toml_read_unlock. It never blocks. */
+const void *toml_read_lock(struct toml_reload *r);
+void toml_read_unlock(struct toml_reload *r, const void *p);
+
+/* A configuration published in shared memory. The template refers to
+   the size bytes at buf, which the publishing process parses into and
+   copies to the segment; other processes read the image in place. */
+struct toml_shm {
+  const struct toml_key *keys; /* the template */
+  void *buf;
+  size_t size;
+  /* The segment, and the image of buf in it. */
+  void *map;
+  const void *image;
+};
+
+/* toml_shm_storage takes the storage the template refers to. */
+#define toml_shm_storage(v) .buf = &(v), .size = sizeof(v)
+
+/* toml_shm_create creates, or opens for publishing, the shared memory
+   object name. toml_shm_open maps it read-only. */
+int toml_shm_create(struct toml_shm *s, const char *name);
+int toml_shm_open(struct toml_shm *s, const char *name);
+
+/* toml_shm_publish parses the TOML-encoded data of f as toml_unmarshal
+   does, and copies the result to the segment. The values must stay in
+   the storage: it fails with errno EINVAL, without parsing, if a key
+   of the template has an allocator, or stores strings outside it. */
+int toml_shm_publish(struct toml_shm *s, FILE *f);
+
+/* Reads of the image go between toml_shm_begin and toml_shm_retry,
+   and must be done again if toml_shm_retry returns true:
+
+       do {
+         gen = toml_shm_begin(&s);
+         ...
+       } while (toml_shm_retry(&s, gen));
+ */
+unsigned long toml_shm_begin(const struct toml_shm *s);
+bool toml_shm_retry(const struct toml_shm *s, unsigned long gen);
+
+/* toml_shm_string returns the string a pointer p in the image refers
+   to: an element of a string array, the string of a variant, the ptr
+   of a view, or what the data of a key points to. */
+#define toml_shm_string(s, p) ((const char *) (s)->image + (size_t) (p))
+
+void toml_shm_close(struct toml_shm *s);
+
+/* A configuration file for toml_load: its path, the template to parse
+   it with, and the errno of reading it, EINVAL if it did not parse, or
+   0. */
+struct toml_file {
+  const char *path;
+  const struct toml_key *keys;
+  int error;
+};
+
+/* toml_load reads and parses the n files, up to depth of them at once,
+   each into a slot of size / depth bytes of buf, which must hold it.
+   The reads go through io_uring where it is available, and the files
+   are parsed on the calling thread as they complete; elsewhere, or with
+   TOML_NO_URING set in the environment, depth threads read and parse
+   them. Files that cannot be read, or do not parse, have their error
+   set, and toml_load returns -1 once the others are loaded; the message
+   of a parse error is kept by the thread that parsed it, see
+   toml_last_error. As the slots are reused, toml_strview keys may not
+   be used. */
+int toml_load(struct toml_file *files, int n, char *buf, size_t size,
+              int depth);
+
+/* The state of a watched TOML file. */
+struct toml_watch {
+  /* The configuration the file is reloaded into. */
+  struct toml_reload *reload;
+  /* How long writes must have stopped, in milliseconds, before the
+     file is looked at. 50 if not set. */
+  int debounce;
+  /* The inotify instance, which can be polled by an event loop. */
+  int fd;
+  const char *path;
+  char name[256];
+  /* A hash of the last revision seen. */
+  unsigned long long hash;
+  bool loaded;
+};
+
+/* toml_watch_open starts watching the file at path for changes. */
+int toml_watch_open(struct toml_watch *w, const char *path);
+
+/* toml_watch_load reloads the watched file into w->reload unless its
+   contents are those of the last revision seen. It returns 1 if a new
+   revision was published, 0 if the file did not change, and -1 on
+   errors, including revisions that do not parse. */
+int toml_watch_load(struct toml_watch *w);
+
+/* toml_watch_wait waits up to timeout milliseconds (-1 for ever) for
+   the watched file to change, and then returns as toml_watch_load. */
+int toml_watch_wait(struct toml_watch *w, int timeout);
+
+void toml_watch_close(struct toml_watch *w);
+
+/* The maximum number of tables in a compiled template. */
+#define TOML_TEMPLATE_MAXTABLES 64
+
+/* A template compiled by toml_compile. The storage the template refers
+   to, with every key set to its default, is kept in an image that is
+   copied over the storage before each parse, and the keys the parse
+   gives a value are marked in a bitmask. A key marked twice is defined
+   twice, and a table is missing keys if it ends with some of the keys
+   marked in the required bitmask not marked. */
+struct toml_template {
+  const struct toml_key *keys; /* the template */
+  void *base;
+  size_t size;
+  /* The image, of size bytes. */
+  char *image;
+  /* The bitmasks, one bit per key, and their capacity in bits. */
+  unsigned long *set, *required;
+  size_t nbits;
+  /* The tables of the template, and the bit of their first key. */
+  struct {
+    const struct toml_key *keys;
+    unsigned int first, n;
+  } tables[TOML_TEMPLATE_MAXTABLES];
+  int ntables;
+};
+
+/* toml_template_storage takes the storage the template refers to, an
+   array of characters of the same size for the image, and two arrays
+   of unsigned long for the bitmasks, as in unsigned long s[2][n]. */
+#define toml_template_storage(v, i, s)                                  \
+  .base = &(v), .size = sizeof(v), .image = i, .set = s[0],             \
+  .required = s[1], .nbits = 8 * sizeof(s[0])
+
+/* toml_compile stores the defaults of the keys of t in its image, and
+   marks the required keys. The storage is left as it is. It returns -1
+   if the template has more tables or keys than t has room for. */
+int toml_compile(struct toml_template *t);
+
+/* toml_unmarshal_compiled restores the storage of t from its image and
+   then parses f into it as toml_unmarshal does. Keys defined twice and
+   required keys left out are errors. */
+int toml_unmarshal_compiled(FILE *f, struct toml_template *t);
+
+/* toml_isset tells whether the key k of t was given a value by the
+   last parse. For the keys of an array of tables, that is the last
+   element. */
+bool toml_isset(const struct toml_template *t, const struct toml_key *k);
+
+/* The phases of a parse, whose costs are counted apart in builds with
+   TOML_PROFILE defined. */
+enum toml_phase {
+  toml_parse_phase,   /* the grammar, and whatever is not below */
+  toml_lex_phase,     /* scanning tokens */
+  toml_lookup_phase,  /* looking keys up in the template */
+  toml_convert_phase, /* converting numbers and booleans */
+  toml_store_phase,   /* writing values to their storage */
+  TOML_NPHASES
+};
+
+/* The costs of a phase. The cycles, instructions, branch misses and
+   cache misses are user-space counts from perf_event_open; where it
+   fails, cycles are those of the time stamp counter, or 0, and the
+   others are 0. */
+struct toml_counters {
+  unsigned long long cycles;
+  unsigned long long instructions;
+  unsigned long long branch_misses;
+  unsigned long long cache_misses;
+};
+
+/* The statistics of the parses of the process since the last
+   toml_stats_reset, those of all threads added up; the max_ members
+   are the largest seen by any of them. They tell how much of their
+   storage templates use, and which parses take slow paths. */
+struct toml_stats {
+  unsigned long long bytes;       /* of input, unless read from a tape */
+  unsigned long long tokens;      /* scanned, or read from a tape */
+  unsigned long long lookups;     /* of keys in templates */
+  unsigned long long probes;      /* keys compared in the lookups */
+  unsigned long long strings;     /* not scanned in place, but copied */
+  unsigned long long stringbytes; /* in the copies */
+  size_t max_store;               /* bytes of the store of an array */
+  size_t max_elements;            /* of an array */
+  size_t max_lexeme;              /* bytes of a token */
+  struct toml_counters phases[TOML_NPHASES];
+};
+
+/* toml_stats_get copies the statistics into s. */
+void toml_stats_get(struct toml_stats *s);
+
+/* toml_stats_reset starts the statistics over. */
+void toml_stats_reset(void);
+
+/* The events of a parse that are traced, see toml_trace. */
+enum toml_event {
+  toml_parse_event,         /* a parse starts */
+  toml_done_event,          /* and ends without error */
+  toml_table_event,         /* a [ table ] or [[ array ]] header */
+  toml_value_event,         /* a value is about to be stored */
+  toml_type_event,          /* a value of the wrong type */
+  toml_number_event,        /* a number that does not convert */
+  toml_boolean_event,       /* neither true nor false */
+  toml_array_full_event,    /* no room for an element */
+  toml_strings_full_event,  /* no room for a string */
+  toml_depth_event,         /* arrays nested deeper than the template */
+  toml_unknown_key_event,   /* a key that is not in the template */
+  toml_syntax_event,        /* any other error */
+  TOML_NEVENTS
+};
+
+/* A trace record: what happened, when and where in the input. */
+struct toml_trace_record {
+  unsigned long long time; /* CLOCK_MONOTONIC, in nanoseconds */
+  unsigned int lineno;
+  unsigned int offset;     /* in bytes, or ~0u if it is not known */
+  unsigned short event;
+  char key[14];            /* the name of the key, cut to fit */
+};
+
+/* A ring of trace records; len is a power of 2. count is how many
+   were ever written, the last of them at records[(count - 1) % len].
+   Threads may write to the same ring at once. */
+struct toml_trace {
+  struct toml_trace_record *records;
+  unsigned long len;
+  unsigned long count;
+};
+
+/* toml_trace has the parses of the calling thread, and those of the
+   threads of toml_unmarshal_parallel it calls, trace their events
+   into t. NULL stops tracing. */
+void toml_trace(struct toml_trace *t);
+
+/* toml_trace_write writes the records of t to f, the oldest first,
+   for toml_trace_read or the tomltrace tool to read back. Records
+   written meanwhile may be torn. */
+int toml_trace_write(const struct toml_trace *t, FILE *f);
+
+/* toml_trace_read reads the records toml_trace_write wrote to f into
+   t, which is empty. */
+int toml_trace_read(struct toml_trace *t, FILE *f);
+
+/* toml_event_name returns the name of the event, as in enum
+   toml_event without the prefix and suffix. */
+const char *toml_event_name(int event);
 
 /* int toml_marshal(); */
 
+/* The error that abandoned a parse: where it was in the input, and
+   what it was. An error that exits the program is also written to
+   stderr; one whose status is returned, as by toml_feed, toml_reload
+   or toml_to_json, is not. */
+struct toml_error {
+  int lineno, column;
+  char message[256];
+};
+
+/* toml_last_error returns the error of the last parse of the calling
+   thread that failed. Its message is empty if none has. */
+const struct toml_error *toml_last_error(void);
+
 /* toml_strerror returns a pointer to a string that describes
    the error code errnum. */
 const char *toml_strerror(int errnum);
@@ -120,6 +631,19 @@ const char *toml_strerror(int errnum);
   .u.array.u.strings.store = s, .u.array.u.strings.storelen = sizeof(s), \
   .u.array.count = n, .u.array.len = (sizeof(p) / sizeof(p[0]))
 
+/* toml_array_variants takes the base address of an array of struct
+   toml_variant, the base address of the storage for strings, and the
+   address of an integer to store the length in. */
+#define toml_array_variants(v, s, n)                                       \
+  .u.array.type = toml_variant_t, .u.array.u.variants.elems = v,           \
+  .u.array.u.variants.store = s, .u.array.u.variants.storelen = sizeof(s), \
+  .u.array.count = n, .u.array.len = (sizeof(v) / sizeof(v[0]))
+
+/* toml_array_matrix takes an array of integers to store the length
+   of each dimension of a nested array in. */
+#define toml_array_matrix(d) \
+  .u.array.shape = d, .u.array.rank = (sizeof(d) / sizeof(d[0]))
+
 /* toml_array_tables takes the base address of an array of structs,
    an array of template of structures describing the expected
    shape of the incoming table, and the address of an integer
@@ -127,11 +651,24 @@ const char *toml_strerror(int errnum);
 #define toml_array_tables(a, t, n)                               \
   .u.array.type = toml_table_t, .u.array.u.tables.subtype = t,   \
   .u.array.u.tables.base = (char *) a,                           \
-  .u.array.u.tables.structsize = sizeof(a[0]), .u.array.len = n, \
-  .u.array.cap = (sizeof(a) / sizeof(a[0]))
+  .u.array.u.tables.structsize = sizeof(a[0]), .u.array.count = n, \
+  .u.array.len = (sizeof(a) / sizeof(a[0]))
+
+/* toml_tape_storage takes an array of tokens and an array of
+   characters to store their lexemes in. */
+#define toml_tape_storage(t, s) \
+  .tokens = t, .len = toml_len(t), .store = s, .storelen = sizeof(s)
+
+/* toml_trace_storage takes an array of trace records, whose length
+   is a power of 2. */
+#define toml_trace_storage(r) .records = r, .len = toml_len(r)
 
 /* toml_table_field takes a structure name s, and a fieldname
    f in s. */
 #define toml_table_field(s, f) .u.offset = offsetof(s, f)
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* TOML_H_ */
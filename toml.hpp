@@ -0,0 +1,282 @@
+#ifndef TOML_HPP_
+#define TOML_HPP_
+
+/* C++17 templates for libtoml. The fields of a struct are described
+   once, and its template, with a perfect hash of the key names of
+   every table, is generated at compile time:
+
+       struct server {
+         char host[64];
+         int port;
+       };
+
+       template <> struct toml::describe<server> {
+         static constexpr auto fields =
+             std::make_tuple(TOML_FIELD(server, host),
+                             TOML_FIELD(server, port));
+       };
+
+       server s = toml::unmarshal<server>(text);
+
+   Fields may be integers, double, bool, arrays of char, toml_strview,
+   and structs that are themselves described, which are tables. The
+   strings of toml_strview fields are left in the text, and may not
+   have escapes. */
+
+#include <array>
+#include <cstddef>
+#include <stdexcept>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include "toml.h"
+
+namespace toml {
+
+/* A key laid out as struct toml_key, which constant expressions can
+   build. */
+struct key {
+  const char *name;
+  enum toml_type type;
+  union value {
+    std::size_t offset;
+    const key *table;
+    const struct toml_hash *hash;
+    struct toml_array array;
+
+    constexpr value() : offset(0) {}
+    constexpr value(std::size_t o) : offset(o) {}
+    constexpr value(const key *t) : table(t) {}
+    constexpr value(const struct toml_hash *h) : hash(h) {}
+  } u;
+  std::size_t size;
+  bool required;
+  const struct toml_allocator *alloc;
+  void **data;
+  union default_value {
+    long integer;
+    double real;
+    bool boolean;
+    const char *string;
+
+    constexpr default_value() : integer(0) {}
+  } dflt;
+};
+
+static_assert(sizeof(key) == sizeof(toml_key) &&
+                  alignof(key) == alignof(toml_key),
+              "toml::key is not laid out as struct toml_key");
+static_assert(offsetof(key, u) == offsetof(toml_key, u) &&
+                  offsetof(key, size) == offsetof(toml_key, size) &&
+                  offsetof(key, required) == offsetof(toml_key, required) &&
+                  offsetof(key, alloc) == offsetof(toml_key, alloc) &&
+                  offsetof(key, dflt) == offsetof(toml_key, dflt),
+              "toml::key is not laid out as struct toml_key");
+
+/* describe<T> is specialized for every struct T to unmarshal, with a
+   tuple of its fields. */
+template <class T>
+struct describe;
+
+/* A field of type F at offset in its struct, named name in TOML. */
+template <class F>
+struct field {
+  using type = F;
+  const char *name;
+  std::size_t offset;
+};
+
+/* TOML_FIELD describes the field f of the struct T, under its own name. */
+#define TOML_FIELD(T, f) \
+  ::toml::field<decltype(T::f)> { #f, offsetof(T, f) }
+
+/* The hash of toml_hash, see toml.h. */
+constexpr unsigned int hash_name(unsigned int seed, const char *name) {
+  unsigned int h = 2166136261u ^ seed;
+
+  while (*name != '\0') {
+    h ^= (unsigned char) *name++;
+    h *= 16777619u;
+  }
+  h ^= h >> 16;
+  h *= 0x85ebca6bu;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35u;
+  h ^= h >> 16;
+  return h;
+}
+
+/* Returns the smallest power of 2 that is at least n. */
+constexpr std::size_t pow2(std::size_t n) {
+  std::size_t p = 1;
+
+  while (p < n)
+    p *= 2;
+  return p;
+}
+
+/* A perfect hash of N names, by hash and displace: the names are put
+   in buckets by their hash, and the seed of each bucket, the largest
+   first, is searched for so that its names go to free slots. */
+template <std::size_t N>
+struct perfect_hash {
+  static constexpr std::size_t nslots = pow2(2 * N);
+  static constexpr std::size_t nbuckets = nslots / 4 ? nslots / 4 : 1;
+  /* The seeds tried for a bucket before giving up, few enough that the
+     error is reported before the compiler's limit on constant
+     evaluation is reached. */
+  static constexpr unsigned int max_seeds = 1u << 12;
+
+  std::array<unsigned int, nbuckets> seeds{};
+  std::array<unsigned short, nslots> slots{};
+
+  constexpr perfect_hash(const std::array<const char *, N> &names) {
+    std::array<std::size_t, N> bucket{};
+    std::array<bool, nbuckets> done{};
+
+    for (std::size_t i = 0; i < N; i++)
+      bucket[i] = hash_name(0, names[i]) & (nbuckets - 1);
+    for (std::size_t round = 0; round < nbuckets; round++) {
+      std::size_t b = 0, most = 0;
+
+      for (std::size_t c = 0; c < nbuckets; c++) {
+        std::size_t n = 0;
+
+        for (std::size_t i = 0; i < N; i++)
+          n += bucket[i] == c;
+        if (!done[c] && (n > most || (n == most && done[b])))
+          b = c, most = n;
+      }
+      done[b] = true;
+      for (unsigned int seed = 1;; seed++) {
+        if (seed == max_seeds)
+          throw std::logic_error("no perfect hash, are names repeated?");
+        if (place(names, bucket, b, seed)) {
+          seeds[b] = seed;
+          break;
+        }
+      }
+    }
+  }
+
+  /* Puts the names of bucket b in the slots seed sends them to, if
+     those are free. */
+  constexpr bool place(const std::array<const char *, N> &names,
+                       const std::array<std::size_t, N> &bucket,
+                       std::size_t b, unsigned int seed) {
+    for (std::size_t i = 0; i < N; i++) {
+      if (bucket[i] != b)
+        continue;
+      std::size_t s = hash_name(seed, names[i]) & (nslots - 1);
+      if (slots[s] != 0) { /* taken: undo this bucket */
+        for (std::size_t j = 0; j < nslots; j++) {
+          if (slots[j] != 0 && bucket[slots[j] - 1] == b)
+            slots[j] = 0;
+        }
+        return false;
+      }
+      slots[s] = (unsigned short) (i + 1);
+    }
+    return true;
+  }
+};
+
+template <class T, class = void>
+struct is_described : std::false_type {};
+template <class T>
+struct is_described<T, std::void_t<decltype(describe<T>::fields)>>
+    : std::true_type {};
+
+/* Returns the type of the values of fields of type F. */
+template <class F>
+constexpr enum toml_type type_of() {
+  if constexpr (std::is_same_v<F, short>)
+    return toml_short_t;
+  else if constexpr (std::is_same_v<F, unsigned short>)
+    return toml_ushort_t;
+  else if constexpr (std::is_same_v<F, int>)
+    return toml_int_t;
+  else if constexpr (std::is_same_v<F, unsigned int>)
+    return toml_uint_t;
+  else if constexpr (std::is_same_v<F, long>)
+    return toml_long_t;
+  else if constexpr (std::is_same_v<F, unsigned long>)
+    return toml_ulong_t;
+  else if constexpr (std::is_same_v<F, double>)
+    return toml_float_t;
+  else if constexpr (std::is_same_v<F, bool>)
+    return toml_bool_t;
+  else if constexpr (std::is_array_v<F> &&
+                     std::is_same_v<std::remove_extent_t<F>, char>)
+    return toml_string_t;
+  else if constexpr (std::is_same_v<F, toml_strview>)
+    return toml_strview_t;
+  else {
+    static_assert(is_described<F>::value, "field of an unsupported type");
+    return toml_table_t;
+  }
+}
+
+/* The template of the struct T, whose keys are offsets from the start
+   of the struct it is a field of, Base bytes before. */
+template <class T, std::size_t Base = 0>
+struct table {
+  using fields_type = std::remove_cv_t<decltype(describe<T>::fields)>;
+  static constexpr std::size_t n = std::tuple_size_v<fields_type>;
+
+  template <std::size_t... I>
+  static constexpr std::array<const char *, n> names(
+      std::index_sequence<I...>) {
+    return {{std::get<I>(describe<T>::fields).name...}};
+  }
+
+  template <std::size_t I>
+  static constexpr key make_key() {
+    constexpr auto f = std::get<I>(describe<T>::fields);
+    using F = typename decltype(f)::type;
+    constexpr enum toml_type type = type_of<F>();
+
+    if constexpr (type == toml_table_t)
+      return key{f.name, type, table<F, Base + f.offset>::keys.data()};
+    else if constexpr (type == toml_string_t)
+      return key{f.name, type, Base + f.offset, sizeof(F)};
+    else
+      return key{f.name, type, Base + f.offset};
+  }
+
+  template <std::size_t... I>
+  static constexpr std::array<key, n + 1> make_keys(
+      std::index_sequence<I...>) {
+    return {{make_key<I>()..., key{nullptr, toml_type(0), &index}}};
+  }
+
+  static constexpr perfect_hash<n> hash{
+      names(std::make_index_sequence<n>{})};
+  static constexpr struct toml_hash index = {
+      (unsigned int) hash.nslots - 1, (unsigned int) hash.nbuckets - 1,
+      hash.seeds.data(), hash.slots.data()};
+  static constexpr std::array<key, n + 1> keys =
+      make_keys(std::make_index_sequence<n>{});
+};
+
+/* template_of returns the template of T, for the C functions. */
+template <class T>
+const struct toml_key *template_of() {
+  return reinterpret_cast<const struct toml_key *>(table<T>::keys.data());
+}
+
+/* unmarshal parses the TOML-encoded text into a T. Errors are handled
+   as by toml_unmarshal. The toml_strview fields of T refer to text. */
+template <class T>
+T unmarshal(std::string_view text) {
+  T v{};
+
+  toml_unmarshal_base(text.data(), text.size(), template_of<T>(), &v);
+  return v;
+}
+
+}  // namespace toml
+
+#endif /* TOML_HPP_ */
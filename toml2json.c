@@ -0,0 +1,65 @@
+/* toml2json - convert a TOML document to JSON.
+ *
+ * Usage: toml2json [file]
+ *
+ * Writes the document, or the standard input, to the standard output
+ * as JSON, with a table wherever its sections are gathered into one
+ * object (see toml_to_json). The document is read into memory whole,
+ * as toml_to_json reads it twice, and its tables and keys are indexed
+ * in 16 MB of scratch, about 250000 of them.
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <stdalign.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "toml.h"
+
+static alignas(max_align_t) char scratch[1 << 24];
+
+int main(int argc, char *argv[]) {
+  FILE *f = stdin;
+  char *input = NULL, *p;
+  size_t len = 0, size = 0;
+  int errnum;
+
+  if (argc > 2) {
+    fprintf(stderr,
+            "usage: %s [file]\n"
+            "The document is read into memory whole; its tables and runs "
+            "of keys\nare indexed in %zu bytes of scratch.\n",
+            argv[0], sizeof(scratch));
+    return 2;
+  }
+  if (argc == 2 && (f = fopen(argv[1], "rb")) == NULL) {
+    perror(argv[1]);
+    return 1;
+  }
+  do {
+    if (len == size) {
+      size = size == 0 ? 1 << 16 : 2 * size;
+      if ((p = realloc(input, size)) == NULL) {
+        perror(argc == 2 ? argv[1] : "stdin");
+        return 1;
+      }
+      input = p;
+    }
+    len += fread(input + len, 1, size - len, f);
+  } while (len == size);
+  if (ferror(f)) {
+    fprintf(stderr, "%s: read error\n", argc == 2 ? argv[1] : "stdin");
+    return 1;
+  }
+  errnum = toml_to_json(input, len, stdout, scratch, sizeof(scratch));
+  free(input);
+  if (errnum == -1) {
+    perror("stdout");
+    return 1;
+  }
+  if (errnum != 0)
+    fprintf(stderr, "%s:%d:%d: %s\n", argc == 2 ? argv[1] : "stdin",
+            toml_last_error()->lineno, toml_last_error()->column,
+            toml_last_error()->message);
+  return errnum;
+}
@@ -0,0 +1,175 @@
+#ifndef TOML_ASYNC_HPP_
+#define TOML_ASYNC_HPP_
+
+/* C++20 coroutines for libtoml. A configuration is read and parsed
+   with toml_feed on the threads of an executor, a chunk at a time, so
+   that other work runs in between:
+
+       server s;
+       char buf[1 << 16];
+
+       int err = co_await toml::load_async(ex, "server.toml", s, buf);
+
+   The executor is anything with a member execute(f) that runs the
+   callable f later on one of its threads, as those of Asio are. As an
+   event loop cannot wait for a regular file to be readable, each
+   callable reads a chunk, parses it, and queues the next, blocking its
+   thread for one read at most. No thread is started. Destroying the
+   awaiting coroutine while the load is pending stops it: nothing is
+   written to the buffer after the destructor of the load returns. */
+
+#include <algorithm>
+#include <cerrno>
+#include <coroutine>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <utility>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "toml.hpp"
+
+namespace toml {
+
+/* The most bytes a load reads at once. */
+inline constexpr std::size_t load_chunk = 1 << 16;
+
+/* A load, awaited by a coroutine whose frame holds it. */
+template <class Executor>
+class load_op {
+ public:
+  load_op(Executor ex, const char *path, const struct toml_key *keys,
+          std::span<char> buf, void *base)
+      : ex_(std::move(ex)), path_(path), buf_(buf),
+        state_(std::make_shared<state>()) {
+    toml_feed_start(&feed_, buf.data(), keys, base);
+  }
+
+  load_op(const load_op &) = delete;
+  load_op &operator=(const load_op &) = delete;
+
+  /* Stops a pending load, waiting for the chunk being read, if any. */
+  ~load_op() {
+    std::lock_guard<std::mutex> lock(state_->mutex);
+    state_->cancelled = true;
+  }
+
+  bool await_ready() const noexcept { return false; }
+
+  void await_suspend(std::coroutine_handle<> h) {
+    waiter_ = h;
+    ex_.execute([this, st = state_] { step(this, st); });
+  }
+
+  /* Returns 0, the status of a document that does not parse, or -1
+     with errno set if the file could not be read. */
+  int await_resume() const noexcept {
+    if (errno_ != 0) {
+      errno = errno_;
+      return -1;
+    }
+    return status_;
+  }
+
+ private:
+  /* What the callables queued on the executor share with the load, and
+     which outlives it: the file, and whether the load is gone. */
+  struct state {
+    std::mutex mutex;
+    bool cancelled = false;
+    int fd = -1;
+
+    ~state() {
+      if (fd >= 0)
+        close(fd);
+    }
+  };
+
+  /* Reads and parses the next chunk of the file for op, unless it is
+     gone, and queues the next step, or resumes the coroutine after the
+     last. */
+  static void step(load_op *op, std::shared_ptr<state> st) {
+    std::unique_lock<std::mutex> lock(st->mutex);
+
+    if (st->cancelled)
+      return;
+    if (op->read_chunk(*st)) {
+      op->ex_.execute([op, st] { step(op, st); });
+      return;
+    }
+    lock.unlock(); /* the coroutine may destroy op */
+    op->waiter_.resume();
+  }
+
+  /* Reads the next chunk of the file into the buffer, which must be
+     larger than it, and parses what has arrived. Returns false once
+     the file is read, with the status of the load set. */
+  bool read_chunk(state &st) {
+    int err = 0;
+
+    if (!opened_) {
+      opened_ = true;
+      if ((st.fd = open(path_, O_RDONLY | O_CLOEXEC)) < 0)
+        err = errno;
+    }
+    while (err == 0) {
+      std::size_t n = std::min(load_chunk, buf_.size() - len_);
+      ssize_t got;
+
+      if (n == 0) {
+        err = EFBIG;
+        break;
+      }
+      got = ::read(st.fd, buf_.data() + len_, n);
+      if (got < 0 && errno == EINTR)
+        continue;
+      if (got < 0)
+        err = errno;
+      if (got <= 0)
+        break;
+      len_ += got;
+      toml_feed(&feed_, len_);
+      return true;
+    }
+    errno_ = err;
+    if (err == 0)
+      status_ = toml_feed_end(&feed_, len_);
+    return false;
+  }
+
+  Executor ex_;
+  const char *path_;
+  std::span<char> buf_;
+  std::size_t len_ = 0;
+  bool opened_ = false;
+  struct toml_feed feed_;
+  std::coroutine_handle<> waiter_;
+  int status_ = 0, errno_ = 0;
+  std::shared_ptr<state> state_;
+};
+
+/* load_async reads the file at path into buf and parses it with the
+   template keys, whose keys are offsets from base, or addresses if base
+   is NULL, on the threads of ex. */
+template <class Executor>
+load_op<Executor> load_async(Executor ex, const char *path,
+                             const struct toml_key *keys,
+                             std::span<char> buf, void *base = nullptr) {
+  return {std::move(ex), path, keys, buf, base};
+}
+
+/* load_async reads the file at path into buf and parses it into v. The
+   toml_strview fields of v refer to buf. */
+template <class T, class Executor>
+  requires is_described<T>::value
+load_op<Executor> load_async(Executor ex, const char *path, T &v,
+                             std::span<char> buf) {
+  return {std::move(ex), path, template_of<T>(), buf, &v};
+}
+
+}  // namespace toml
+
+#endif /* TOML_ASYNC_HPP_ */
@@ -0,0 +1,171 @@
+#include "toml_async.hpp"
+
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <string>
+#include <thread>
+
+struct limits {
+  unsigned short connections;
+  double timeout;
+};
+
+struct server {
+  char host[32];
+  int port;
+  toml_strview root;
+  struct limits limits;
+};
+
+template <>
+struct toml::describe<limits> {
+  static constexpr auto fields =
+      std::make_tuple(TOML_FIELD(limits, connections),
+                      TOML_FIELD(limits, timeout));
+};
+
+template <>
+struct toml::describe<server> {
+  static constexpr auto fields = std::make_tuple(
+      TOML_FIELD(server, host), TOML_FIELD(server, port),
+      TOML_FIELD(server, root), TOML_FIELD(server, limits));
+};
+
+static void assert_true(const char *what, bool ok) {
+  if (!ok) {
+    printf("'%s' failed.\n", what);
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* An event loop run by the main thread, and its executor. */
+struct loop {
+  std::mutex mutex;
+  std::condition_variable ready;
+  std::deque<std::function<void()>> jobs;
+  bool done = false;
+
+  void run() {
+    while (!done) {
+      std::unique_lock<std::mutex> lock(mutex);
+
+      ready.wait(lock, [this] { return !jobs.empty(); });
+      auto job = std::move(jobs.front());
+      jobs.pop_front();
+      lock.unlock();
+      job();
+    }
+  }
+
+  struct executor {
+    loop *l;
+
+    void execute(std::function<void()> f) const {
+      std::lock_guard<std::mutex> lock(l->mutex);
+      l->jobs.push_back(std::move(f));
+      l->ready.notify_one();
+    }
+  };
+};
+
+/* A coroutine that runs until it is done, unawaited. */
+struct detached {
+  struct promise_type {
+    detached get_return_object() { return {}; }
+    std::suspend_never initial_suspend() { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+  };
+};
+
+/* A coroutine that is destroyed by its owner, awaited or not. */
+struct owned {
+  struct promise_type {
+    owned get_return_object() {
+      return {std::coroutine_handle<promise_type>::from_promise(*this)};
+    }
+    std::suspend_never initial_suspend() { return {}; }
+    std::suspend_always final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+  };
+
+  std::coroutine_handle<promise_type> h;
+};
+
+static char buf[4 * toml::load_chunk];
+static char untouched[4 * toml::load_chunk];
+
+static detached load(loop &l, const char *path) {
+  loop::executor ex{&l};
+  std::thread::id self = std::this_thread::get_id();
+  server s{};
+  int err;
+
+  err = co_await toml::load_async(ex, path, s, buf);
+  assert_true("err", err == 0);
+  assert_true("resumed on the loop", std::this_thread::get_id() == self);
+  assert_true("host", strcmp(s.host, "example.org") == 0);
+  assert_true("port", s.port == 8080);
+  assert_true("root",
+              std::string_view(s.root.ptr, s.root.len) == "/srv/www");
+  assert_true("root in buf",
+              s.root.ptr > buf && s.root.ptr < buf + sizeof(buf));
+  assert_true("limits.connections", s.limits.connections == 512);
+  assert_true("limits.timeout", s.limits.timeout == 2.5);
+
+  err = co_await toml::load_async(ex, "/nonexistent/server.toml", s, buf);
+  assert_true("missing file", err == -1 && errno == ENOENT);
+  l.done = true;
+}
+
+/* Starts a load into untouched that is destroyed before it runs. */
+static owned abandon(loop &l, const char *path) {
+  loop::executor ex{&l};
+  server s{};
+
+  co_await toml::load_async(ex, path, s, untouched);
+  assert_true("not resumed", false);
+}
+
+int main() {
+  char path[] = "/tmp/toml_async_testXXXXXX";
+  int fd = mkstemp(path);
+  std::string text =
+      "host = \"example.org\"\n"
+      "port = 8080\n"
+      "root = '/srv/www'\n";
+  loop l;
+
+  /* long enough to arrive in several chunks */
+  while (text.size() < 2 * toml::load_chunk)
+    text += "# the connections to take at once, and how long to wait\n";
+  text += "[limits]\n"
+          "connections = 512\n"
+          "timeout = 2.5\n";
+  assert_true("mkstemp", fd >= 0);
+  assert_true("write",
+              write(fd, text.data(), text.size()) == (ssize_t) text.size());
+  close(fd);
+
+  printf("TEST toml_async.hpp: ");
+  load(l, path);
+  l.run();
+
+  l.done = false;
+  memset(untouched, 'x', sizeof(untouched));
+  abandon(l, path).h.destroy();
+  loop::executor{&l}.execute([&l] { l.done = true; });
+  l.run();
+  assert_true("untouched", untouched[0] == 'x' &&
+                               memcmp(untouched, untouched + 1,
+                                      sizeof(untouched) - 1) == 0);
+  unlink(path);
+  puts("ok");
+  return 0;
+}
@@ -0,0 +1,98 @@
+#include "toml.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+struct limits {
+  unsigned short connections;
+  double timeout;
+};
+
+struct server {
+  char host[32];
+  int port;
+  bool tls;
+  long backlog;
+  toml_strview root;
+  struct limits limits;
+};
+
+template <>
+struct toml::describe<limits> {
+  static constexpr auto fields =
+      std::make_tuple(TOML_FIELD(limits, connections),
+                      TOML_FIELD(limits, timeout));
+};
+
+template <>
+struct toml::describe<server> {
+  static constexpr auto fields = std::make_tuple(
+      TOML_FIELD(server, host), TOML_FIELD(server, port),
+      TOML_FIELD(server, tls), TOML_FIELD(server, backlog),
+      TOML_FIELD(server, root), TOML_FIELD(server, limits));
+};
+
+/* The low bits of the hashes of root and limits were once the same for
+   every seed, so that no perfect hash of them was found. */
+struct cfg {
+  int root;
+  struct limits limits;
+  int x;
+};
+
+template <>
+struct toml::describe<cfg> {
+  static constexpr auto fields =
+      std::make_tuple(TOML_FIELD(cfg, root), TOML_FIELD(cfg, limits),
+                      TOML_FIELD(cfg, x));
+};
+
+/* Every name must be found in its own slot. */
+static_assert(toml::table<server>::keys[6].u.hash ==
+              &toml::table<server>::index);
+static_assert(toml::table<server>::keys[5].u.table ==
+              toml::table<limits, offsetof(server, limits)>::keys.data());
+
+static void assert_true(const char *what, bool ok) {
+  if (!ok) {
+    printf("'%s' failed.\n", what);
+    exit(EXIT_FAILURE);
+  }
+}
+
+int main() {
+  const char text[] =
+      "host = \"example.org\"\n"
+      "port = 8080\n"
+      "tls = true\n"
+      "backlog = 128\n"
+      "root = '/srv/www'\n"
+      "\n"
+      "[limits]\n"
+      "connections = 512\n"
+      "timeout = 2.5\n";
+  server s = toml::unmarshal<server>(text);
+
+  printf("TEST toml.hpp: ");
+  assert_true("host", strcmp(s.host, "example.org") == 0);
+  assert_true("port", s.port == 8080);
+  assert_true("tls", s.tls);
+  assert_true("backlog", s.backlog == 128);
+  assert_true("root", std::string_view(s.root.ptr, s.root.len) == "/srv/www");
+  assert_true("root in text",
+              s.root.ptr > text && s.root.ptr < text + sizeof(text));
+  assert_true("limits.connections", s.limits.connections == 512);
+  assert_true("limits.timeout", s.limits.timeout == 2.5);
+
+  cfg c = toml::unmarshal<cfg>(
+      "root = 1\n"
+      "x = 3\n"
+      "[limits]\n"
+      "connections = 2\n");
+  assert_true("cfg.root", c.root == 1);
+  assert_true("cfg.limits.connections", c.limits.connections == 2);
+  assert_true("cfg.x", c.x == 3);
+  puts("ok");
+  return 0;
+}
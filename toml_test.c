@@ -1,27 +1,31 @@
 #include "toml.h"
 
+#include <errno.h>
 #include <limits.h>
+#include <math.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
-// static void assert_real(const char *key, double want, double got)
-// {
-//   if (want != got) {
-//     printf("'%s' expecting '%f', got '%f'.\n", key, want, got);
-//     exit(EXIT_FAILURE);
-//   }
-// }
+static void assert_real(const char *key, double want, double got) {
+  if (want != got) {
+    printf("'%s' expecting '%f', got '%f'.\n", key, want, got);
+    exit(EXIT_FAILURE);
+  }
+}
 
-// static void assert_boolean(const char *key, bool want, bool got)
-// {
-//   if (want != got) {
-//     printf("'%s' expecting '%s', got '%s'.\n", key, want ? "true" : "false",
-//            got ? "true" : "false");
-//     exit(EXIT_FAILURE);
-//   }
-// }
+static void assert_boolean(const char *key, bool want, bool got) {
+  if (want != got) {
+    printf("'%s' expecting '%s', got '%s'.\n", key, want ? "true" : "false",
+           got ? "true" : "false");
+    exit(EXIT_FAILURE);
+  }
+}
 
 static void assert_signed_integer(const char *key, long int want,
                                   long int got) {
@@ -39,110 +43,12 @@ static void assert_unsigned_integer(const char *key, unsigned long int want,
   }
 }
 
-// static void assert_string(const char *key, const char *want, const char *got)
-// {
-//   if (strcmp(got, want)) {
-//     printf("fail: '%s' expecting '%s', got '%s'.\n", key, want, got);
-//     exit(EXIT_FAILURE);
-//   }
-// }
-
-// int test_tables(FILE *fp)
-// {
-//   struct toml {
-//     char type[8];
-//     char device[16];
-//     bool lorawan_public;
-//     int clksrc;
-//     struct {
-//       bool enable;
-//       char type[8];
-//       int freq;
-//       double rssi_offset;
-//     } table0;
-//     struct {
-//       bool enable;
-//       unsigned short radio;
-//       int if_freq;
-//     } table1;
-//   } toml;
-//   int err;
-
-//   const struct toml_key_t table0[] = {
-//       {"enable", boolean_t, .ptr.boolean = &toml.table0.enable},
-//       {"type", string_t, .ptr.string = toml.table0.type,
-//        .len = sizeof(toml.table0.type)},
-//       {"freq", toml_int_t, .ptr.integer = &toml.table0.freq},
-//       {"rssi_offset", real_t, .ptr.real = &toml.table0.rssi_offset},
-//       {NULL}};
-//   const struct toml_key_t table1[] = {
-//       {"enable", boolean_t, .ptr.boolean = &toml.table1.enable},
-//       {"radio", ushort_t, .ptr.ushortint = &toml.table1.radio},
-//       {"if", toml_int_t, .ptr.integer = &toml.table1.if_freq},
-//       {NULL}};
-//   const struct toml_key_t root[] = {
-//       {"type", string_t, .ptr.string = toml.type, .len = sizeof(toml.type)},
-//       {"device", string_t, .ptr.string = toml.device,
-//        .len = sizeof(toml.device)},
-//       {"clksrc", toml_int_t, .ptr.integer = &toml.clksrc},
-//       {"lorawan_public", boolean_t, .ptr.boolean = &toml.lorawan_public},
-//       {"table-0", table_t, .ptr.keys = table0},
-//       {"table-1", table_t, .ptr.keys = table1},
-//       {NULL}};
-
-//   err = toml_unmarshal(fp, root);
-//   if (err != 0) {
-//     printf("toml_unmarshal failed: %s\n", toml_strerror(err));
-//     return -1;
-//   }
-
-//   assert_string("type", "SPI", toml.type);
-//   assert_string("device", "/dev/spidev0.0", toml.device);
-//   assert_signed_integer("clksrc", 0, toml.clksrc);
-//   assert_boolean("lorawan_public", true, toml.lorawan_public);
-
-//   assert_boolean("table-0.enable", true, toml.table0.enable);
-//   assert_string("table-0.type", "SX1250", toml.table0.type);
-//   assert_signed_integer("table-0.freq", 917200000, toml.table0.freq);
-//   assert_real("table-0.rssi_offset", -215.4, toml.table0.rssi_offset);
-
-//   assert_boolean("table-1.enable", true, toml.table1.enable);
-//   assert_unsigned_integer("table-1.radio", 0, toml.table1.radio);
-//   assert_signed_integer("table-1.if", -200000, toml.table1.if_freq);
-//   return 0;
-// }
-
-// int test_inline_tables(FILE *fp)
-// {
-//   char first[32], last[32];
-//   int x, y;
-//   int err;
-//   const struct toml_key_t name_keys[] = {
-//       {"first", string_t, .ptr.string = first, .len = sizeof(first)},
-//       {"last", string_t, .ptr.string = last, .len = sizeof(last)},
-//       {NULL}};
-//   const struct toml_key_t point_keys[] = {{"x", toml_int_t, .ptr.integer =
-//   &x},
-//                                           {"y", toml_int_t, .ptr.integer =
-//                                           &y}, {NULL}};
-//   const struct toml_key_t math_keys[] = {
-//       {"point", table_t, .ptr.keys = point_keys}, {NULL}};
-//   const struct toml_key_t root[] = {{"name", table_t, .ptr.keys = name_keys},
-//                                     {"math", table_t, .ptr.keys = math_keys},
-//                                     {NULL}};
-
-//   err = toml_unmarshal(fp, root);
-//   if (err != 0) {
-//     printf("toml_unmarshal failed: %s\n", toml_strerror(err));
-//     return -1;
-//   }
-
-//   assert_string("name.first", "Ethan", first);
-//   assert_string("name.last", "Hawke", last);
-//   assert_signed_integer("math.point.x", 1, x);
-//   assert_signed_integer("math.point.y", 2, y);
-//   return 0;
-// }
+static void assert_string(const char *key, const char *want, const char *got) {
+  if (strcmp(got, want)) {
+    printf("fail: '%s' expecting '%s', got '%s'.\n", key, want, got);
+    exit(EXIT_FAILURE);
+  }
+}
 
 // int test_array_integers(FILE *fp)
 // {
@@ -256,193 +162,547 @@ static void assert_unsigned_integer(const char *key, unsigned long int want,
 //   return 0;
 // }
 
-// int test_array_strings(FILE *fp)
-// {
-//   int err;
-//   char *strings1[3];
-//   char strings1store[64];
-//   int count1;
-//   char *strings2[3];
-//   char strings2store[64];
-//   int count2;
-//   char *strings3[3];
-//   char strings3store[2];
-//   int count3;
-//   const struct toml_key_t keys[] = {
-//       {"strings1", array_t, STRINGARRAY(strings1, strings1store, &count1)},
-//       {"strings2", array_t, STRINGARRAY(strings2, strings2store, &count2)},
-//       {"strings3", array_t, STRINGARRAY(strings3, strings3store, &count3)},
-//       {NULL}};
+void tables_test(FILE *f) {
+  struct toml {
+    char type[8];
+    char device[16];
+    bool lorawan_public;
+    int clksrc;
+    struct {
+      bool enable;
+      char type[8];
+      int freq;
+      double rssi_offset;
+    } table0;
+    struct {
+      bool enable;
+      unsigned short radio;
+      int if_freq;
+    } table1;
+  } toml;
+  const struct toml_key table0[] = {
+      {"enable", toml_bool_t, .u.boolean = &toml.table0.enable},
+      {"type", toml_string_t, .u.string = toml.table0.type,
+       .size = sizeof(toml.table0.type)},
+      {"freq", toml_int_t, .u.integer.i = &toml.table0.freq},
+      {"rssi_offset", toml_float_t, .u.real = &toml.table0.rssi_offset},
+      {NULL}};
+  const struct toml_key table1[] = {
+      {"enable", toml_bool_t, .u.boolean = &toml.table1.enable},
+      {"radio", toml_ushort_t, .u.integer.us = &toml.table1.radio},
+      {"if", toml_int_t, .u.integer.i = &toml.table1.if_freq},
+      {NULL}};
+  const struct toml_key root[] = {
+      {"type", toml_string_t, .u.string = toml.type, .size = sizeof(toml.type)},
+      {"device", toml_string_t, .u.string = toml.device,
+       .size = sizeof(toml.device)},
+      {"clksrc", toml_int_t, .u.integer.i = &toml.clksrc},
+      {"lorawan_public", toml_bool_t, .u.boolean = &toml.lorawan_public},
+      {"table-0", toml_table_t, .u.table = table0},
+      {"table-1", toml_table_t, .u.table = table1},
+      {NULL}};
+  int errnum;
 
-//   err = toml_unmarshal(fp, keys);
-//   if (err != 0) {
-//     printf("toml_unmarshal failed: %s\n", toml_strerror(err));
-//     return -1;
-//   }
+  errnum = toml_unmarshal(f, root);
+  assert_signed_integer("errnum", 0, errnum);
 
-//   assert_signed_integer("count1", 3, count1);
-//   assert_string("strings1[0]", "one", strings1[0]);
-//   assert_string("strings1[1]", "two", strings1[1]);
-//   assert_string("strings1[2]", "three", strings1[2]);
+  assert_string("type", "SPI", toml.type);
+  assert_string("device", "/dev/spidev0.0", toml.device);
+  assert_signed_integer("clksrc", 0, toml.clksrc);
+  assert_boolean("lorawan_public", true, toml.lorawan_public);
 
-//   assert_signed_integer("count2", 3, count2);
-//   assert_string("strings2[0]", "four", strings2[0]);
-//   assert_string("strings2[1]", "five", strings2[1]);
-//   assert_string("strings2[2]", "thisisalongstring", strings2[2]);
+  assert_boolean("table-0.enable", true, toml.table0.enable);
+  assert_string("table-0.type", "SX1250", toml.table0.type);
+  assert_signed_integer("table-0.freq", 917200000, toml.table0.freq);
+  assert_real("table-0.rssi_offset", -215.4, toml.table0.rssi_offset);
 
-//   assert_signed_integer("count3", 0, count3);
-//   return 0;
-// }
+  assert_boolean("table-1.enable", true, toml.table1.enable);
+  assert_unsigned_integer("table-1.radio", 0, toml.table1.radio);
+  assert_signed_integer("table-1.if", -200000, toml.table1.if_freq);
+}
 
-// int test_array_inline_tables(FILE *fp)
-// {
-//   struct point {
-//     int x, y, z;
-//   };
-//   struct point points[4];
-//   int count;
-//   const struct toml_key_t point_keys[] = {
-//       {"x", toml_int_t, TABLEFIELD(struct point, x)},
-//       {"y", toml_int_t, TABLEFIELD(struct point, y)},
-//       {"z", toml_int_t, TABLEFIELD(struct point, z)},
-//       {NULL}};
-//   const struct toml_key_t root[] = {
-//       {"points", array_t, TABLEARRAY(points, point_keys, &count)}, {NULL}};
-//   int err;
+void nested_arrays_test(FILE *f) {
+  char buf[BUFSIZ];
+  size_t len;
+  int matrix[6], matrixshape[2], nmatrix;
+  long cube[8];
+  int cubeshape[4], ncube;
+  struct toml_variant mixed[8];
+  char mixedstore[16];
+  int nmixed;
+  double weights[4];
+  int weightsshape[2], nweights;
+  short bias[2];
+  int biasshape[2], nbias;
+  const struct toml_key layer[] = {
+      {"bias", toml_array_t, .u.array.type = toml_short_t,
+       .u.array.u.integer.s = bias, .u.array.count = &nbias,
+       .u.array.len = toml_len(bias), toml_array_matrix(biasshape)},
+      {NULL}};
+  const struct toml_key template[] = {
+      {"matrix", toml_array_t, .u.array.type = toml_int_t,
+       .u.array.u.integer.i = matrix, .u.array.count = &nmatrix,
+       .u.array.len = toml_len(matrix), toml_array_matrix(matrixshape)},
+      {"cube", toml_array_t, .u.array.type = toml_long_t,
+       .u.array.u.integer.l = cube, .u.array.count = &ncube,
+       .u.array.len = toml_len(cube), toml_array_matrix(cubeshape)},
+      {"mixed", toml_array_t, toml_array_variants(mixed, mixedstore, &nmixed)},
+      {"weights", toml_array_t, .u.array.type = toml_float_t,
+       .u.array.u.real = weights, .u.array.count = &nweights,
+       .u.array.len = toml_len(weights), toml_array_matrix(weightsshape)},
+      {"layer", toml_table_t, .u.table = layer},
+      {NULL}};
+  int errnum;
 
-//   err = toml_unmarshal(fp, root);
-//   if (err != 0) {
-//     printf("toml_unmarshal failed: %s\n", toml_strerror(err));
-//     return -1;
-//   }
+  len = fread(buf, 1, sizeof(buf), f);
+  /* in two sections, the second starting at [layer] */
+  errnum = toml_unmarshal_parallel(buf, len, template, 2);
+  assert_signed_integer("errnum", 0, errnum);
 
-//   struct point want[] = {{1, 3, 2}, {5, -2, 4}, {2, 1, 3}, {-4, 7, -1}};
-//   assert_signed_integer("count", 4, count);
-//   for (int i = 0; i < 4; i++) {
-//     char buf[16];
+  assert_signed_integer("nmatrix", 6, nmatrix);
+  assert_signed_integer("matrix rows", 2, matrixshape[0]);
+  assert_signed_integer("matrix columns", 3, matrixshape[1]);
+  assert_signed_integer("matrix[1][2]", 6, matrix[5]);
 
-//     snprintf(buf, sizeof(buf), "points[%d].x", i);
-//     assert_signed_integer(buf, want[i].x, points[i].x);
+  assert_signed_integer("ncube", 8, ncube);
+  assert_signed_integer("cube depth", 2, cubeshape[2]);
+  assert_signed_integer("cube rank", 0, cubeshape[3]);
+  assert_signed_integer("cube[1][0][1]", 6, cube[5]);
 
-//     snprintf(buf, sizeof(buf), "points[%d].y", i);
-//     assert_signed_integer(buf, want[i].y, points[i].y);
+  assert_signed_integer("nmixed", 8, nmixed);
+  assert_signed_integer("mixed[0]", 1, mixed[0].u.integer);
+  assert_string("mixed[1]", "two", mixed[1].u.string);
+  assert_signed_integer("mixed[2]", 35, (long) (mixed[2].u.real * 10));
+  assert_signed_integer("mixed[3] type", toml_array_t, mixed[3].type);
+  assert_signed_integer("mixed[3] count", 2, mixed[3].u.array.count);
+  assert_signed_integer("mixed[3] size", 3, mixed[3].u.array.size);
+  assert_boolean("mixed[3][0]", true, mixed[4].u.boolean);
+  assert_signed_integer("mixed[3][1] count", 1, mixed[5].u.array.count);
+  assert_string("mixed[3][1][0]", "five", mixed[6].u.string);
+  assert_signed_integer("mixed[4] type", toml_bool_t, mixed[7].type);
 
-//     snprintf(buf, sizeof(buf), "points[%d].z", i);
-//     assert_signed_integer(buf, want[i].z, points[i].z);
-//   }
-//   return 0;
-// }
+  assert_signed_integer("nweights", 4, nweights);
+  assert_signed_integer("weights rows", 2, weightsshape[0]);
+  assert_signed_integer("weights[1][0]", 125, (long) (weights[2] * 1000));
 
-// int test_array_tables(FILE *fp)
-// {
-//   enum { NCHANNELS = 8 };
-//   struct channel {
-//     bool enable;
-//     int radio;
-//     int if_freq;
-//   };
-//   struct channel channels[NCHANNELS];
-//   int count;
-//   const struct toml_key_t chantab[] = {
-//       {"enable", boolean_t, .ptr.offset = offsetof(struct channel, enable)},
-//       {"radio", toml_int_t, .ptr.offset = offsetof(struct channel, radio)},
-//       {"if", toml_int_t, .ptr.offset = offsetof(struct channel, if_freq)},
-//       {NULL}};
-//   const struct toml_key_t root[] = {
-//       {"channels", array_t, .ptr.array.type = table_t,
-//        .ptr.array.arr.tables.subtype = chantab,
-//        .ptr.array.arr.tables.base = (char *) channels,
-//        .ptr.array.arr.tables.structsize = sizeof(channels[0]),
-//        .ptr.array.count = &count,
-//        .ptr.array.maxlen = sizeof(channels) / sizeof(channels[0])},
-//       {NULL}};
-//   int err;
+  assert_signed_integer("nbias", 2, nbias);
+  assert_signed_integer("bias columns", 1, biasshape[1]);
+  assert_signed_integer("bias[1][0]", 2, bias[1]);
+}
 
-//   err = toml_unmarshal(fp, root);
-//   if (err != 0) {
-//     printf("toml_unmarshal failed: %s\n", toml_strerror(err));
-//     return -1;
-//   }
+/* Parses the file, and again from memory, where arrays of decimal
+   numbers are parsed without the lexer, and compares the two. */
+void numeric_arrays_test(FILE *f) {
+  char buf[BUFSIZ];
+  size_t len;
+  long ids[2][8], counts[2][8], signs[2][8];
+  double weights[2][8], specials[2][8];
+  int matrix[2][4], matrixshape[2][2];
+  int nids[2], ncounts[2], nweights[2], nmatrix[2];
+  int nsigns[2], nspecials[2];
+  long lines[4];
+  int nlines;
+  const struct toml_key linestab[] = {
+      {"a", toml_array_t, .u.array.type = toml_long_t,
+       .u.array.u.integer.l = lines, .u.array.count = &nlines,
+       .u.array.len = toml_len(lines)},
+      {NULL}};
+  const char badline[] = "a = [\n 1,\n 2,\n]\n@";
+  struct toml_trace_record records[8];
+  struct toml_trace trace = {toml_trace_storage(records)};
+  struct toml_feed feed;
+  int i, errnum;
 
-//   struct channel want[] = {{true, 0, -400000},  {true, 0, -200000},
-//                            {false, 0, 0},       {true, 0, 200000},
-//                            {false, 1, -300000}, {true, 1, -100000},
-//                            {true, 1, 100000},   {false, 1, 300000}};
+  len = fread(buf, 1, sizeof(buf), f);
+  rewind(f);
+  for (i = 0; i < 2; i++) {
+    const struct toml_key template[] = {
+        {"ids", toml_array_t, .u.array.type = toml_long_t,
+         .u.array.u.integer.l = ids[i], .u.array.count = &nids[i],
+         .u.array.len = toml_len(ids[i])},
+        {"counts", toml_array_t, .u.array.type = toml_long_t,
+         .u.array.u.integer.l = counts[i], .u.array.count = &ncounts[i],
+         .u.array.len = toml_len(counts[i])},
+        {"weights", toml_array_t, .u.array.type = toml_float_t,
+         .u.array.u.real = weights[i], .u.array.count = &nweights[i],
+         .u.array.len = toml_len(weights[i])},
+        {"matrix", toml_array_t, .u.array.type = toml_int_t,
+         .u.array.u.integer.i = matrix[i], .u.array.count = &nmatrix[i],
+         .u.array.len = toml_len(matrix[i]), toml_array_matrix(matrixshape[i])},
+        {"signed", toml_array_t, .u.array.type = toml_long_t,
+         .u.array.u.integer.l = signs[i], .u.array.count = &nsigns[i],
+         .u.array.len = toml_len(signs[i])},
+        {"specials", toml_array_t, .u.array.type = toml_float_t,
+         .u.array.u.real = specials[i], .u.array.count = &nspecials[i],
+         .u.array.len = toml_len(specials[i])},
+        {NULL}};
 
-//   assert_signed_integer("count", NCHANNELS, count);
+    if (i == 0)
+      errnum = toml_unmarshal(f, template);
+    else
+      errnum = toml_unmarshal_base(buf, len, template, NULL);
+    assert_signed_integer("errnum", 0, errnum);
+  }
 
-//   for (int i = 0; i < NCHANNELS; i++) {
-//     char buf[32];
+  assert_signed_integer("nids", 6, nids[1]);
+  assert_signed_integer("ids[0]", 12345678, ids[1][0]);
+  assert_signed_integer("ids[1]", -987654321012, ids[1][1]);
+  assert_signed_integer("ids[2]", 42, ids[1][2]);
+  assert_signed_integer("ids[4]", 1000, ids[1][4]);
+  assert_signed_integer("ids[5]", 7, ids[1][5]);
+  assert_signed_integer("ncounts", 7, ncounts[1]);
+  assert_signed_integer("counts[5]", 16, counts[1][5]);
+  assert_signed_integer("counts[6]", 123456789012345678, counts[1][6]);
+  assert_signed_integer("nweights", 6, nweights[1]);
+  assert_real("weights[1]", -0.125, weights[1][1]);
+  assert_real("weights[2]", 3.1415926535, weights[1][2]);
+  assert_signed_integer("nmatrix", 4, nmatrix[1]);
+  assert_signed_integer("matrix columns", 2, matrixshape[1][1]);
+  assert_signed_integer("matrix[1][1]", 4, matrix[1][3]);
 
-//     snprintf(buf, sizeof(buf), "channels[%d].enable", i);
-//     assert_boolean(buf, want[i].enable, channels[i].enable);
+  assert_boolean("ids", true,
+                 memcmp(ids[0], ids[1], nids[1] * sizeof(long)) == 0);
+  assert_boolean("counts", true,
+                 memcmp(counts[0], counts[1], ncounts[1] * sizeof(long)) == 0);
+  assert_boolean("weights", true,
+                 memcmp(weights[0], weights[1],
+                        nweights[1] * sizeof(double)) == 0);
+  assert_boolean("matrix", true,
+                 memcmp(matrix[0], matrix[1], nmatrix[1] * sizeof(int)) == 0);
 
-//     snprintf(buf, sizeof(buf), "channels[%d].radio", i);
-//     assert_signed_integer(buf, want[i].radio, channels[i].radio);
+  /* elements after the first that the lexer has to take */
+  for (i = 0; i < 2; i++) {
+    assert_signed_integer("nsigned", 5, nsigns[i]);
+    assert_signed_integer("signed[1]", -2000, signs[i][1]);
+    assert_signed_integer("signed[2]", 3, signs[i][2]);
+    assert_signed_integer("signed[3]", 16, signs[i][3]);
+    assert_signed_integer("signed[4]", -4, signs[i][4]);
+    assert_signed_integer("nspecials", 4, nspecials[i]);
+    assert_boolean("specials[1]", true,
+                   isinf(specials[i][1]) && specials[i][1] < 0);
+    assert_boolean("specials[2]", true, isnan(specials[i][2]));
+    assert_real("specials[3]", -2.5, specials[i][3]);
+  }
 
-//     snprintf(buf, sizeof(buf), "channels[%d].if", i);
-//     assert_signed_integer(buf, want[i].if_freq, channels[i].if_freq);
-//   }
-//   return 0;
-// }
+  /* the newlines of the elements taken count, and only those */
+  toml_trace(&trace);
+  toml_feed_start(&feed, badline, linestab, NULL);
+  errnum = toml_feed_end(&feed, sizeof(badline) - 1);
+  toml_trace(NULL);
+  assert_boolean("bad line", true, errnum != 0);
+  assert_string("syntax event", "syntax",
+                toml_event_name(records[trace.count - 1].event));
+  assert_signed_integer("syntax lineno", 5, records[trace.count - 1].lineno);
+}
 
-// int test_array_tables_2(FILE *fp)
-// {
-//   struct product {
-//     long sku;
-//     char name[16];
-//     char color[16];
-//   };
-//   struct product products[3] = {0};
-//   int count;
-//   bool enable;
-//   int radio, if_freq;
-//   const struct toml_key_t chantab[] = {
-//       {"enable", boolean_t, .ptr.boolean = &enable},
-//       {"radio", toml_int_t, .ptr.integer = &radio},
-//       {"if", toml_int_t, .ptr.integer = &if_freq},
-//       {NULL}};
-//   const struct toml_key_t prodtab[] = {
-//       {"name", string_t, TABLEFIELD(struct product, name),
-//        .len = sizeof(products[0].name)},
-//       {"sku", long_t, TABLEFIELD(struct product, sku)},
-//       {"color", string_t, TABLEFIELD(struct product, color),
-//        .len = sizeof(products[0].color)},
-//       {NULL}};
-//   const struct toml_key_t root[] = {
-//       {"products", array_t, TABLEARRAY(products, prodtab, &count)},
-//       {"channel", table_t, .ptr.keys = chantab},
-//       {NULL}};
-//   int err;
+void inline_tables_test(FILE *f) {
+  char first[32], last[32];
+  int x, y;
+  const struct toml_key name_keys[] = {
+      {"first", toml_string_t, .u.string = first, .size = sizeof(first)},
+      {"last", toml_string_t, .u.string = last, .size = sizeof(last)},
+      {NULL}};
+  const struct toml_key point_keys[] = {{"x", toml_int_t, .u.integer.i = &x},
+                                        {"y", toml_int_t, .u.integer.i = &y},
+                                        {NULL}};
+  const struct toml_key math_keys[] = {
+      {"point", toml_table_t, .u.table = point_keys}, {NULL}};
+  const struct toml_key root[] = {{"name", toml_table_t, .u.table = name_keys},
+                                  {"math", toml_table_t, .u.table = math_keys},
+                                  {NULL}};
+  int errnum;
 
-//   err = toml_unmarshal(fp, root);
-//   if (err != 0) {
-//     printf("toml_unmarshal failed: %s\n", toml_strerror(err));
-//     return -1;
-//   }
+  errnum = toml_unmarshal(f, root);
+  assert_signed_integer("errnum", 0, errnum);
 
-//   struct product want[] = {
-//       {738594937, "Hammer", ""}, {0, "", ""}, {284758393, "Nail", "gray"}};
+  assert_string("name.first", "Ethan", first);
+  assert_string("name.last", "Hawke", last);
+  assert_signed_integer("math.point.x", 1, x);
+  assert_signed_integer("math.point.y", 2, y);
+}
 
-//   assert_signed_integer("count", 3, count);
+void array_inline_tables_test(FILE *f) {
+  struct point {
+    int x, y, z;
+  };
+  struct point points[4];
+  int count;
+  const struct toml_key point_keys[] = {
+      {"x", toml_int_t, toml_table_field(struct point, x)},
+      {"y", toml_int_t, toml_table_field(struct point, y)},
+      {"z", toml_int_t, toml_table_field(struct point, z)},
+      {NULL}};
+  const struct toml_key root[] = {
+      {"points", toml_array_t, toml_array_tables(points, point_keys, &count)},
+      {NULL}};
+  int errnum;
 
-//   for (int i = 0; i < 3; i++) {
-//     char buf[32];
+  errnum = toml_unmarshal(f, root);
+  assert_signed_integer("errnum", 0, errnum);
 
-//     snprintf(buf, sizeof(buf), "products[%d].name", i);
-//     assert_string(buf, want[i].name, products[i].name);
+  struct point want[] = {{1, 3, 2}, {5, -2, 4}, {2, 1, 3}, {-4, 7, -1}};
+  assert_signed_integer("count", 4, count);
+  for (int i = 0; i < 4; i++) {
+    char buf[16];
 
-//     snprintf(buf, sizeof(buf), "products[%d].sku", i);
-//     assert_signed_integer(buf, want[i].sku, products[i].sku);
+    snprintf(buf, sizeof(buf), "points[%d].x", i);
+    assert_signed_integer(buf, want[i].x, points[i].x);
 
-//     snprintf(buf, sizeof(buf), "products[%d].color", i);
-//     assert_string(buf, want[i].color, products[i].color);
-//   }
-//   assert_boolean("channel.enable", true, enable);
-//   assert_signed_integer("channel.radio", 0, radio);
-//   assert_signed_integer("channel.if", -400000, if_freq);
-//   return 0;
-// }
+    snprintf(buf, sizeof(buf), "points[%d].y", i);
+    assert_signed_integer(buf, want[i].y, points[i].y);
+
+    snprintf(buf, sizeof(buf), "points[%d].z", i);
+    assert_signed_integer(buf, want[i].z, points[i].z);
+  }
+}
+
+enum { NCHANNELS = 8 };
+struct channel {
+  bool enable;
+  int radio;
+  int if_freq;
+};
+
+static void assert_channels(const struct channel *channels, int count) {
+  struct channel want[] = {{true, 0, -400000},  {true, 0, -200000},
+                           {false, 0, 0},       {true, 0, 200000},
+                           {false, 1, -300000}, {true, 1, -100000},
+                           {true, 1, 100000},   {false, 1, 300000}};
+
+  assert_signed_integer("count", NCHANNELS, count);
+
+  for (int i = 0; i < NCHANNELS; i++) {
+    char buf[32];
+
+    snprintf(buf, sizeof(buf), "channels[%d].enable", i);
+    assert_boolean(buf, want[i].enable, channels[i].enable);
+
+    snprintf(buf, sizeof(buf), "channels[%d].radio", i);
+    assert_signed_integer(buf, want[i].radio, channels[i].radio);
+
+    snprintf(buf, sizeof(buf), "channels[%d].if", i);
+    assert_signed_integer(buf, want[i].if_freq, channels[i].if_freq);
+  }
+}
+
+void array_tables_test(FILE *f) {
+  struct channel channels[NCHANNELS];
+  int count;
+  const struct toml_key chantab[] = {
+      {"enable", toml_bool_t, toml_table_field(struct channel, enable)},
+      {"radio", toml_int_t, toml_table_field(struct channel, radio)},
+      {"if", toml_int_t, toml_table_field(struct channel, if_freq)},
+      {NULL}};
+  const struct toml_key root[] = {
+      {"channels", toml_array_t, toml_array_tables(channels, chantab, &count)},
+      {NULL}};
+  int errnum;
+
+  errnum = toml_unmarshal(f, root);
+  assert_signed_integer("errnum", 0, errnum);
+  assert_channels(channels, count);
+}
+
+/* An arena for the arrays and strings that outgrow their storage. */
+struct arena {
+  char buf[4096];
+  size_t used;
+  int frees;
+};
+
+static void *arena_alloc(void *ctx, size_t size) {
+  struct arena *a = ctx;
+  void *p;
+
+  size = (size + 15) & ~(size_t) 15;
+  if (size > sizeof(a->buf) - a->used)
+    return NULL;
+  p = a->buf + a->used;
+  a->used += size;
+  return p;
+}
+
+static void arena_free(void *ctx, void *p, size_t size) {
+  struct arena *a = ctx;
+
+  (void) p, (void) size;
+  a->frees++;
+}
+
+/* Parses the channels into an array with room for one, which grows. */
+void alloc_test(FILE *f) {
+  static struct arena arena;
+  const struct toml_allocator alloc = {arena_alloc, arena_free, &arena};
+  struct channel one[1], *channels;
+  int count;
+  const struct toml_key chantab[] = {
+      {"enable", toml_bool_t, toml_table_field(struct channel, enable)},
+      {"radio", toml_int_t, toml_table_field(struct channel, radio)},
+      {"if", toml_int_t, toml_table_field(struct channel, if_freq)},
+      {NULL}};
+  const struct toml_key root[] = {
+      {"channels", toml_array_t, toml_array_tables(one, chantab, &count),
+       .alloc = &alloc, .data = (void **) &channels},
+      {NULL}};
+  int errnum;
+
+  errnum = toml_unmarshal(f, root);
+  assert_signed_integer("errnum", 0, errnum);
+  assert_signed_integer("frees", 2, arena.frees); /* the blocks of 2 and 4 */
+  assert_channels(channels, count);
+}
+
+/* Parses the channels in four concurrent sections. */
+void parallel_test(FILE *f) {
+  char buf[BUFSIZ];
+  size_t len;
+  struct channel channels[NCHANNELS];
+  int count;
+  const struct toml_key chantab[] = {
+      {"enable", toml_bool_t, toml_table_field(struct channel, enable)},
+      {"radio", toml_int_t, toml_table_field(struct channel, radio)},
+      {"if", toml_int_t, toml_table_field(struct channel, if_freq)},
+      {NULL}};
+  const struct toml_key root[] = {
+      {"channels", toml_array_t, toml_array_tables(channels, chantab, &count)},
+      {NULL}};
+  int errnum;
+
+  len = fread(buf, 1, sizeof(buf), f);
+  errnum = toml_unmarshal_parallel(buf, len, root, 4);
+  assert_signed_integer("errnum", 0, errnum);
+  assert_channels(channels, count);
+}
+
+/* Parses the channels as they arrive, seven bytes at a time, and then
+   a document that does not. */
+void feed_test(FILE *f) {
+  char buf[BUFSIZ];
+  size_t len, n;
+  struct channel channels[NCHANNELS];
+  int count;
+  const struct toml_key chantab[] = {
+      {"enable", toml_bool_t, toml_table_field(struct channel, enable)},
+      {"radio", toml_int_t, toml_table_field(struct channel, radio)},
+      {"if", toml_int_t, toml_table_field(struct channel, if_freq)},
+      {NULL}};
+  const struct toml_key root[] = {
+      {"channels", toml_array_t, toml_array_tables(channels, chantab, &count)},
+      {NULL}};
+  const char bad[] = "[[channels]]\nradio = 1\n[[channels]]\nradio = x\n";
+  struct toml_feed feed;
+  int errnum;
+
+  len = fread(buf, 1, sizeof(buf), f);
+  toml_feed_start(&feed, buf, root, NULL);
+  for (n = 0; n + 7 < len; n += 7) {
+    errnum = toml_feed(&feed, n);
+    assert_signed_integer("errnum", 0, errnum);
+  }
+  /* the first channels are parsed before the end */
+  assert_signed_integer("channels[0].if", -400000, channels[0].if_freq);
+  errnum = toml_feed_end(&feed, len);
+  assert_signed_integer("errnum", 0, errnum);
+  assert_channels(channels, count);
+
+  toml_feed_start(&feed, bad, root, NULL);
+  errnum = toml_feed(&feed, sizeof(bad) - 1);
+  assert_signed_integer("errnum", 0, errnum);
+  assert_signed_integer("radio", 1, channels[0].radio);
+  errnum = toml_feed_end(&feed, sizeof(bad) - 1);
+  assert_boolean("bad document", true, errnum != 0);
+  assert_signed_integer("errnum again", errnum,
+                        toml_feed_end(&feed, sizeof(bad) - 1));
+}
+
+/* Converts the document to JSON, gathering the sections of each table,
+   and then with too little scratch to index it. */
+void json_test(FILE *f) {
+  static _Alignas(max_align_t) char scratch[4096];
+  const char want[] =
+      "{\"title\":\"a \\\"quoted\\\"\\ttitle\",\"port\":8080,"
+      "\"server\":{\"host\":\"example.org\",\"tls\":{\"enabled\":true}},"
+      "\"owner\":{\"name\":\"Tom\",\"born\":\"1979-05-27\","
+      "\"address\":{\"city\":\"Geneva\"}},"
+      "\"products\":[{\"name\":\"Hammer\",\"sizes\":[1,2,3]},"
+      "{\"name\":\"Nail\",\"weight\":\"-inf\"}],"
+      "\"database\":{\"ports\":[[8000,8001],[8002]],"
+      "\"limits\":{\"connections\":512,\"timeout\":2.5,"
+      "\"modes\":[true,false]}}}\n";
+  char buf[BUFSIZ];
+  char *json;
+  size_t len, jsonlen;
+  FILE *out;
+  int errnum;
+
+  len = fread(buf, 1, sizeof(buf), f);
+  out = open_memstream(&json, &jsonlen);
+  errnum = toml_to_json(buf, len, out, scratch, sizeof(scratch));
+  fclose(out);
+  assert_signed_integer("errnum", 0, errnum);
+  assert_string("json", want, json);
+  free(json);
+
+  out = open_memstream(&json, &jsonlen);
+  errnum = toml_to_json(buf, len, out, scratch, 64);
+  fclose(out);
+  assert_boolean("out of scratch", true, errnum > 0);
+  assert_string("message", "out of scratch", toml_last_error()->message);
+  free(json);
+}
+
+void array_tables_2_test(FILE *f) {
+  struct product {
+    long sku;
+    char name[16];
+    char color[16];
+  };
+  struct product products[3] = {0};
+  int count;
+  bool enable;
+  int radio, if_freq;
+  const struct toml_key chantab[] = {
+      {"enable", toml_bool_t, .u.boolean = &enable},
+      {"radio", toml_int_t, .u.integer.i = &radio},
+      {"if", toml_int_t, .u.integer.i = &if_freq},
+      {NULL}};
+  const struct toml_key prodtab[] = {
+      {"name", toml_string_t, toml_table_field(struct product, name),
+       .size = sizeof(products[0].name)},
+      {"sku", toml_long_t, toml_table_field(struct product, sku)},
+      {"color", toml_string_t, toml_table_field(struct product, color),
+       .size = sizeof(products[0].color)},
+      {NULL}};
+  const struct toml_key root[] = {
+      {"products", toml_array_t, toml_array_tables(products, prodtab, &count)},
+      {"channel", toml_table_t, .u.table = chantab},
+      {NULL}};
+  int errnum;
+
+  errnum = toml_unmarshal(f, root);
+  assert_signed_integer("errnum", 0, errnum);
+
+  struct product want[] = {
+      {738594937, "Hammer", ""}, {0, "", ""}, {284758393, "Nail", "gray"}};
+
+  assert_signed_integer("count", 3, count);
+
+  for (int i = 0; i < 3; i++) {
+    char buf[32];
+
+    snprintf(buf, sizeof(buf), "products[%d].name", i);
+    assert_string(buf, want[i].name, products[i].name);
+
+    snprintf(buf, sizeof(buf), "products[%d].sku", i);
+    assert_signed_integer(buf, want[i].sku, products[i].sku);
+
+    snprintf(buf, sizeof(buf), "products[%d].color", i);
+    assert_string(buf, want[i].color, products[i].color);
+  }
+  assert_boolean("channel.enable", true, enable);
+  assert_signed_integer("channel.radio", 0, radio);
+  assert_signed_integer("channel.if", -400000, if_freq);
+}
 
 void integers_test(FILE *f) {
   short int1;
@@ -485,19 +745,1165 @@ void integers_test(FILE *f) {
   assert_signed_integer("min", LONG_MIN, min);
 }
 
+void strings_test(FILE *f) {
+  char str1[64], str2[32], str3[32], str4[64], str5[64], str6[128], str7[64],
+      str8[64], str9[64], str10[64], str11[64];
+  const struct toml_key template[] = {
+      {"str1", toml_string_t, .u.string = str1, .size = sizeof(str1)},
+      {"str2", toml_string_t, .u.string = str2, .size = sizeof(str2)},
+      {"str3", toml_string_t, .u.string = str3, .size = sizeof(str3)},
+      {"str4", toml_string_t, .u.string = str4, .size = sizeof(str4)},
+      {"str5", toml_string_t, .u.string = str5, .size = sizeof(str5)},
+      {"str6", toml_string_t, .u.string = str6, .size = sizeof(str6)},
+      {"str7", toml_string_t, .u.string = str7, .size = sizeof(str7)},
+      {"str8", toml_string_t, .u.string = str8, .size = sizeof(str8)},
+      {"str9", toml_string_t, .u.string = str9, .size = sizeof(str9)},
+      {"str10", toml_string_t, .u.string = str10, .size = sizeof(str10)},
+      {"str11", toml_string_t, .u.string = str11, .size = sizeof(str11)},
+      {NULL}};
+  int errnum;
+
+  errnum = toml_unmarshal(f, template);
+  assert_signed_integer("errnum", 0, errnum);
+
+  assert_string("str1",
+                "I'm a string. \"You can quote me\". Name\tJos\xc3\xa9\n"
+                "Location\tSF.",
+                str1);
+  assert_string("str2", "caf\xc3\xa9 \xe2\x82\xac \xf0\x9f\x98\x80", str2);
+  assert_string("str3",
+                "\xc3\xb1" "and\xc3\xba \xe2\x80\x93 "
+                "\xe6\x97\xa5\xe6\x9c\xac\xe8\xaa\x9e",
+                str3);
+  assert_string("str4", "C:\\Users\\nodejs\\templates \xe2\x80\x94 literal",
+                str4);
+  assert_string("str5", "Roses are red\nViolets are blue", str5);
+  assert_string("str6",
+                "The first newline is\ntrimmed in raw strings.\n"
+                "   All other whitespace\n   is preserved. \\n stays put.\n",
+                str6);
+  assert_string("str7",
+                "Here are fifteen quotation marks: \"\"\"\"\"\"\"\"\"\"\"\"\"\"\"",
+                str7);
+  assert_string("str8", "'That,' she said, 'is still pointless.'", str8);
+  assert_string("str9", "The quick brown fox jumps over the lazy dog.", str9);
+  assert_string("str10", "Here are two quotation marks: \"\". Simple enough.",
+                str10);
+  assert_string("str11", "\"This,\" she said, \"is just a pointless statement.\"",
+                str11);
+}
+
+/* Parses strings longer than a window of the stream, which are copied
+   a run at a time, into storage that truncates them. */
+void long_strings_test(FILE *f) {
+  static char doc[1 << 18];
+  char str1[64], str2[64], str3[64], str4[64];
+  int after;
+  const struct toml_key template[] = {
+      {"str1", toml_string_t, .u.string = str1, .size = sizeof(str1)},
+      {"str2", toml_string_t, .u.string = str2, .size = sizeof(str2)},
+      {"str3", toml_string_t, .u.string = str3, .size = sizeof(str3)},
+      {"str4", toml_string_t, .u.string = str4, .size = sizeof(str4)},
+      {"after", toml_int_t, .u.integer.i = &after},
+      {NULL}};
+  const char *keys[] = {"str1 = \"", "str2 = '", "str3 = \"\"\"\n",
+                        "str4 = '''\n"};
+  const char *ends[] = {"\"\n", "'\n", "\"\"\"\n", "'''\n"};
+  size_t len = 0;
+
+  (void) f;
+  for (int k = 0; k < 4; k++) {
+    len += sprintf(doc + len, "%s", keys[k]);
+    for (int i = 0; i < 1500; i++) /* across windows */
+      len += sprintf(doc + len,
+                     k < 2 ? "%038d \xc3\xa9" : "%038d\xc3\xa9\n", i);
+    len += sprintf(doc + len, "%s", ends[k]);
+  }
+  len += sprintf(doc + len, "after = 7\n");
+
+  for (int pass = 0; pass < 2; pass++) {
+    FILE *in = fmemopen(doc, len, "r");
+    int errnum;
+
+    after = 0;
+    errnum = pass == 0 ? toml_unmarshal(in, template)
+                       : toml_unmarshal_base(doc, len, template, NULL);
+    fclose(in);
+    assert_signed_integer("errnum", 0, errnum);
+    assert_string("str1",
+                  "00000000000000000000000000000000000000 \xc3\xa9"
+                  "0000000000000000000000",
+                  str1);
+    assert_string("str2", str1, str2);
+    assert_string("str3",
+                  "00000000000000000000000000000000000000\xc3\xa9\n"
+                  "0000000000000000000000",
+                  str3);
+    assert_string("str4", str3, str4);
+    assert_signed_integer("after", 7, after);
+  }
+
+  /* sequences in the middle of a run are validated as in lex_utf8 */
+  const char *bad[] = {"str1 = \"caf\xc3\xa9 \xe0\x80\x80 ok\"\n",
+                       "str2 = 'caf\xc3\xa9 \xed\xa0\x80 ok'\n",
+                       "str1 = \"caf\xc3\xa9 \xf4\x90\x80\x80\"\n",
+                       "str2 = 'caf\xc3\xa9 \xc3'\n"};
+  for (int i = 0; i < 4; i++) {
+    struct toml_feed feed;
+
+    toml_feed_start(&feed, bad[i], template, NULL);
+    assert_signed_integer("bad UTF-8", 2,
+                          toml_feed_end(&feed, strlen(bad[i])));
+  }
+}
+
+void array_strings_test(FILE *f) {
+  char *strings1[3];
+  char strings1store[64];
+  int count1;
+  char *strings2[3];
+  char strings2store[64];
+  int count2;
+  char *strings3[3];
+  char strings3store[2];
+  int count3;
+  const struct toml_key template[] = {
+      {"strings1", toml_array_t,
+       toml_array_strings(strings1, strings1store, &count1)},
+      {"strings2", toml_array_t,
+       toml_array_strings(strings2, strings2store, &count2)},
+      {"strings3", toml_array_t,
+       toml_array_strings(strings3, strings3store, &count3)},
+      {NULL}};
+  int errnum;
+
+  errnum = toml_unmarshal(f, template);
+  assert_signed_integer("errnum", 0, errnum);
+
+  assert_signed_integer("count1", 3, count1);
+  assert_string("strings1[0]", "one", strings1[0]);
+  assert_string("strings1[1]", "two", strings1[1]);
+  assert_string("strings1[2]", "three", strings1[2]);
+
+  assert_signed_integer("count2", 3, count2);
+  assert_string("strings2[0]", "four", strings2[0]);
+  assert_string("strings2[1]", "five", strings2[1]);
+  assert_string("strings2[2]", "thisisalongstring", strings2[2]);
+
+  assert_signed_integer("count3", 0, count3);
+}
+
+/* Checks that the view v holds want, and whether it is in buf. */
+static void assert_view(const char *key, const char *want,
+                        struct toml_strview v, const char *buf, size_t len,
+                        bool inbuf) {
+  char got[128];
+
+  snprintf(got, sizeof(got), "%.*s", (int) v.len, v.ptr);
+  assert_string(key, want, got);
+  assert_boolean(key, inbuf, v.ptr >= buf && v.ptr < buf + len);
+}
+
+void strview_test(FILE *f) {
+  char buf[BUFSIZ];
+  size_t len;
+  struct toml_strview str1, str3, str4, str7, str8, str9, str11;
+  char store1[64], store9[64], store11[64];
+  const struct toml_key template[] = {
+      {"str1", toml_strview_t, .u.strview = {&str1, store1},
+       .size = sizeof(store1)},
+      {"str2", toml_strview_t},
+      {"str3", toml_strview_t, .u.strview.view = &str3},
+      {"str4", toml_strview_t, .u.strview.view = &str4},
+      {"str5", toml_strview_t},
+      {"str6", toml_strview_t},
+      {"str7", toml_strview_t, .u.strview.view = &str7},
+      {"str8", toml_strview_t, .u.strview.view = &str8},
+      {"str9", toml_strview_t, .u.strview = {&str9, store9},
+       .size = sizeof(store9)},
+      {"str10", toml_strview_t},
+      {"str11", toml_strview_t, .u.strview = {&str11, store11},
+       .size = sizeof(store11)},
+      {NULL}};
+  int errnum;
+
+  len = fread(buf, 1, sizeof(buf), f);
+  errnum = toml_unmarshal_base(buf, len, template, NULL);
+  assert_signed_integer("errnum", 0, errnum);
+
+  assert_view("str1",
+              "I'm a string. \"You can quote me\". Name\tJos\xc3\xa9\n"
+              "Location\tSF.",
+              str1, buf, len, false);
+  assert_view("str3",
+              "\xc3\xb1" "and\xc3\xba \xe2\x80\x93 "
+              "\xe6\x97\xa5\xe6\x9c\xac\xe8\xaa\x9e",
+              str3, buf, len, true);
+  assert_view("str4", "C:\\Users\\nodejs\\templates \xe2\x80\x94 literal",
+              str4, buf, len, true);
+  assert_view("str7",
+              "Here are fifteen quotation marks: \"\"\"\"\"\"\"\"\"\"\"\"\"\"\"",
+              str7, buf, len, true);
+  assert_view("str8", "'That,' she said, 'is still pointless.'", str8, buf,
+              len, true);
+  assert_view("str9", "The quick brown fox jumps over the lazy dog.", str9,
+              buf, len, false);
+  assert_view("str11", "\"This,\" she said, \"is just a pointless statement.\"",
+              str11, buf, len, false);
+}
+
+/* Parses twice into a compiled template, so that the values the first
+   parse left are seen to be reset to their defaults. */
+void defaults_test(FILE *f) {
+  struct {
+    char device[16], name[16];
+    int count, port;
+    bool flag;
+    double speed;
+  } v;
+  const struct toml_key template[] = {
+      {"device", toml_string_t, .u.string = v.device, .size = sizeof(v.device)},
+      {"count", toml_int_t, .u.integer.i = &v.count, .dflt.integer = 1},
+      {"flag", toml_bool_t, .u.boolean = &v.flag},
+      {"speed", toml_float_t, .u.real = &v.speed},
+      {"port", toml_int_t, .u.integer.i = &v.port, .dflt.integer = 8080},
+      {"name", toml_string_t, .u.string = v.name, .size = sizeof(v.name),
+       .dflt.string = "anonymous"},
+      {NULL}};
+  char image[sizeof(v)];
+  unsigned long bits[2][1];
+  struct toml_template t = {.keys = template,
+                            toml_template_storage(v, image, bits)};
+  int errnum;
+
+  errnum = toml_compile(&t);
+  assert_signed_integer("errnum", 0, errnum);
+  for (int i = 0; i < 2; i++) {
+    rewind(f);
+    errnum = toml_unmarshal_compiled(f, &t);
+    assert_signed_integer("errnum", 0, errnum);
+
+    assert_string("device", "/dev/spidev0.0", v.device);
+    assert_signed_integer("count", 4, v.count);
+    assert_signed_integer("port", 8080, v.port);
+    assert_string("name", "anonymous", v.name);
+    assert_boolean("count is set", true, toml_isset(&t, &template[1]));
+    assert_boolean("port is set", false, toml_isset(&t, &template[4]));
+    v.port = 0;
+    strcpy(v.name, "changed");
+  }
+}
+
+/* Returns the exit status of a child that parses f into t, as parse
+   errors exit. */
+static int compiled_status(FILE *f, struct toml_template *t) {
+  pid_t pid;
+  int status;
+
+  fflush(stdout);
+  if ((pid = fork()) == 0) {
+    freopen("/dev/null", "w", stderr);
+    exit(toml_unmarshal_compiled(f, t));
+  }
+  waitpid(pid, &status, 0);
+  return WEXITSTATUS(status);
+}
+
+void required_test(FILE *f) {
+  struct {
+    struct channel channels[NCHANNELS];
+    int count, gain;
+  } v;
+  struct toml_key chantab[] = {
+      {"enable", toml_bool_t, toml_table_field(struct channel, enable)},
+      {"radio", toml_int_t, toml_table_field(struct channel, radio),
+       .required = true},
+      {"if", toml_int_t, toml_table_field(struct channel, if_freq)},
+      {NULL}};
+  struct toml_key root[] = {
+      {"channels", toml_array_t,
+       toml_array_tables(v.channels, chantab, &v.count)},
+      {"gain", toml_int_t, .u.integer.i = &v.gain},
+      {NULL}};
+  char image[sizeof(v)];
+  unsigned long bits[2][1];
+  struct toml_template t = {.keys = root,
+                            toml_template_storage(v, image, bits)};
+  char twice[] = "[[channels]]\nradio = 0\nradio = 1\n";
+  FILE *dup;
+  int errnum;
+
+  assert_signed_integer("compile", 0, toml_compile(&t));
+  errnum = toml_unmarshal_compiled(f, &t);
+  assert_signed_integer("errnum", 0, errnum);
+  assert_channels(v.channels, v.count);
+
+  root[1].required = true;
+  assert_signed_integer("compile", 0, toml_compile(&t));
+  rewind(f);
+  assert_signed_integer("missing gain", 2, compiled_status(f, &t));
+
+  root[1].required = false;
+  chantab[1].required = false;
+  assert_signed_integer("compile", 0, toml_compile(&t));
+  dup = fmemopen(twice, strlen(twice), "r");
+  assert_signed_integer("radio twice", 2, compiled_status(dup, &t));
+  fclose(dup);
+}
+
+/* Checks the required keys of tables the document leaves out, or only
+   reaches with dotted keys, and tables defined by both. */
+void required_tables_test(FILE *f) {
+  struct {
+    char name[16];
+    int channel, power;
+  } v;
+  struct toml_key radio[] = {
+      {"channel", toml_int_t, .u.integer.i = &v.channel, .required = true},
+      {"power", toml_int_t, .u.integer.i = &v.power},
+      {NULL}};
+  struct toml_key root[] = {
+      {"name", toml_string_t, .u.string = v.name, .size = sizeof(v.name)},
+      {"radio", toml_table_t, .u.table = radio},
+      {NULL}};
+  char image[sizeof(v)];
+  unsigned long bits[2][1];
+  struct toml_template t = {.keys = root,
+                            toml_template_storage(v, image, bits)};
+  const struct {
+    const char *what, *doc;
+    int status;
+  } cases[] = {
+      {"missing table", "name = 'gw'\n", 2},
+      {"dotted without it", "radio.power = 1\n", 2},
+      {"dotted", "radio.channel = 1\nradio.power = 2\n", 0},
+      {"header", "[radio]\nchannel = 1\n", 0},
+      {"dotted then header", "radio.channel = 1\n[radio]\npower = 2\n", 2},
+  };
+
+  (void) f;
+  assert_signed_integer("compile", 0, toml_compile(&t));
+  for (size_t i = 0; i < toml_len(cases); i++) {
+    FILE *in = fmemopen((void *) cases[i].doc, strlen(cases[i].doc), "r");
+
+    assert_signed_integer(cases[i].what, cases[i].status,
+                          compiled_status(in, &t));
+    fclose(in);
+  }
+}
+
+/* Parses the strings into storage too small for them, which grows. */
+void alloc_strings_test(FILE *f) {
+  static struct arena arena;
+  const struct toml_allocator alloc = {arena_alloc, NULL, &arena};
+  char *ptrs[3], store[16], *ptrs2[1], store2[4], **strings2;
+  int count;
+  const struct toml_key template[] = {
+      {"strings1", toml_array_t, toml_array_strings(ptrs, store, &count)},
+      {"strings2", toml_array_t, toml_array_strings(ptrs2, store2, &count),
+       .alloc = &alloc, .data = (void **) &strings2},
+      {"strings3", toml_array_t, toml_array_strings(ptrs, store, &count)},
+      {NULL}};
+  int errnum;
+
+  errnum = toml_unmarshal(f, template);
+  assert_signed_integer("errnum", 0, errnum);
+
+  assert_signed_integer("count3", 0, count);
+  assert_string("strings2[0]", "four", strings2[0]);
+  assert_string("strings2[1]", "five", strings2[1]);
+  assert_string("strings2[2]", "thisisalongstring", strings2[2]);
+}
+
+/* Tokenizes the document once, and unmarshals it twice. */
+void tape_test(FILE *f) {
+  struct toml_token tokens[64];
+  char store[256];
+  struct toml_tape tape = {toml_tape_storage(tokens, store)};
+  char device[2][16];
+  int count[2];
+  bool flag[2];
+  double speed[2];
+  int errnum;
+
+  errnum = toml_tokenize(f, &tape);
+  assert_signed_integer("errnum", 0, errnum);
+
+  for (int i = 0; i < 2; i++) {
+    const struct toml_key template[] = {
+        {"device", toml_string_t, .u.string = device[i],
+         .size = sizeof(device[i])},
+        {"count", toml_int_t, .u.integer.i = &count[i]},
+        {"flag", toml_bool_t, .u.boolean = &flag[i]},
+        {"speed", toml_float_t, .u.real = &speed[i]},
+        {NULL}};
+
+    errnum = toml_unmarshal_tape(&tape, template);
+    assert_signed_integer("errnum", 0, errnum);
+
+    assert_string("device", "/dev/spidev0.0", device[i]);
+    assert_signed_integer("count", 4, count[i]);
+    assert_signed_integer("flag", true, flag[i]);
+    assert_signed_integer("speed", 76213, (long) (speed[i] * 1000 + 0.5));
+  }
+}
+
+/* Parses the file and checks what its statistics account for. */
+void stats_test(FILE *f) {
+  struct toml_stats stats;
+  char device[16];
+  int count;
+  bool flag;
+  double speed;
+  const struct toml_key template[] = {
+      {"device", toml_string_t, .u.string = device, .size = sizeof(device)},
+      {"count", toml_int_t, .u.integer.i = &count},
+      {"flag", toml_bool_t, .u.boolean = &flag},
+      {"speed", toml_float_t, .u.real = &speed},
+      {NULL}};
+  int errnum;
+
+  toml_stats_reset();
+  errnum = toml_unmarshal(f, template);
+  assert_signed_integer("errnum", 0, errnum);
+  toml_stats_get(&stats);
+  assert_unsigned_integer("bytes", ftell(f), stats.bytes);
+  assert_unsigned_integer("lookups", 4, stats.lookups);
+  assert_unsigned_integer("probes", 1 + 2 + 3 + 4, stats.probes);
+  assert_unsigned_integer("strings", 0, stats.strings); /* in place */
+  assert_unsigned_integer("max_lexeme", strlen("/dev/spidev0.0"),
+                          stats.max_lexeme);
+  assert_boolean("tokens", true, stats.tokens >= 4 * 3);
+#if defined(TOML_PROFILE) && (defined(__x86_64__) || defined(__i386__))
+  for (int i = 0; i < TOML_NPHASES; i++)
+    assert_boolean("cycles", true, stats.phases[i].cycles > 0);
+#else
+  assert_unsigned_integer("cycles", 0, stats.phases[toml_lex_phase].cycles);
+#endif
+
+  toml_stats_reset();
+  toml_stats_get(&stats);
+  assert_unsigned_integer("reset", 0, stats.phases[toml_parse_phase].cycles);
+  assert_unsigned_integer("reset", 0, stats.bytes);
+
+  {
+    const char doc[] = "names = [\"ab\", \"cde\"]\n";
+    char *names[4], store[16];
+    int n;
+    const struct toml_key keys[] = {
+        {"names", toml_array_t, toml_array_strings(names, store, &n)},
+        {NULL}};
+
+    errnum = toml_unmarshal_base(doc, strlen(doc), keys, NULL);
+    assert_signed_integer("errnum", 0, errnum);
+    toml_stats_get(&stats);
+    assert_unsigned_integer("bytes", strlen(doc), stats.bytes);
+    assert_unsigned_integer("max_store", 3 + 4, stats.max_store);
+    assert_unsigned_integer("max_elements", 2, stats.max_elements);
+  }
+}
+
+/* Traces a parse, and reads the trace back as tomltrace does. */
+void trace_test(FILE *f) {
+  struct toml_trace_record records[8], copies[8];
+  struct toml_trace trace = {toml_trace_storage(records)};
+  struct toml_trace copy = {toml_trace_storage(copies)};
+  char device[16];
+  int count;
+  bool flag;
+  double speed;
+  const struct toml_key template[] = {
+      {"device", toml_string_t, .u.string = device, .size = sizeof(device)},
+      {"count", toml_int_t, .u.integer.i = &count},
+      {"flag", toml_bool_t, .u.boolean = &flag},
+      {"speed", toml_float_t, .u.real = &speed},
+      {NULL}};
+  FILE *tmp;
+  int errnum;
+
+  toml_trace(&trace);
+  errnum = toml_unmarshal(f, template);
+  toml_trace(NULL);
+  assert_signed_integer("errnum", 0, errnum);
+  assert_unsigned_integer("count", 6, trace.count);
+  assert_string("records[0]", "parse", toml_event_name(records[0].event));
+  assert_string("records[1]", "value", toml_event_name(records[1].event));
+  assert_string("records[1] key", "device", records[1].key);
+  assert_signed_integer("records[1] lineno", 3, records[1].lineno);
+  assert_unsigned_integer("records[1] offset", 58, records[1].offset);
+  assert_string("records[4] key", "speed", records[4].key);
+  assert_string("records[5]", "done", toml_event_name(records[5].event));
+  assert_boolean("time", true, records[5].time >= records[0].time);
+
+  tmp = tmpfile();
+  assert_signed_integer("write", 0, toml_trace_write(&trace, tmp));
+  rewind(tmp);
+  assert_signed_integer("read", 0, toml_trace_read(&copy, tmp));
+  fclose(tmp);
+  assert_unsigned_integer("copy count", 6, copy.count);
+  assert_boolean("copy", true,
+                 memcmp(records, copies, 6 * sizeof(records[0])) == 0);
+}
+
+/* Parses the file and an array longer than the window of the reader
+   from a pipe, written to in small pieces. */
+void fd_test(FILE *f) {
+  enum { N = 20000 };
+  static long values[N];
+  char buf[BUFSIZ], device[16];
+  size_t len;
+  int count, nvalues, fds[2], status;
+  bool flag;
+  double speed;
+  long sum = 0;
+  const struct toml_key template[] = {
+      {"device", toml_string_t, .u.string = device, .size = sizeof(device)},
+      {"count", toml_int_t, .u.integer.i = &count},
+      {"flag", toml_bool_t, .u.boolean = &flag},
+      {"speed", toml_float_t, .u.real = &speed},
+      {"values", toml_array_t, .u.array.type = toml_long_t,
+       .u.array.u.integer.l = values, .u.array.count = &nvalues,
+       .u.array.len = N},
+      {NULL}};
+  pid_t pid;
+  int errnum;
+
+  len = fread(buf, 1, sizeof(buf), f);
+  if (pipe(fds) != 0) {
+    perror("pipe");
+    exit(1);
+  }
+  if ((pid = fork()) == 0) {
+    FILE *w;
+
+    close(fds[0]);
+    w = fdopen(fds[1], "w");
+    setvbuf(w, NULL, _IOFBF, 1000);
+    fwrite(buf, 1, len, w);
+    fputs("values = [", w);
+    for (int i = 0; i < N; i++)
+      fprintf(w, "%d,%s", i * 7, i % 10 == 9 ? "\n" : " ");
+    fputs("]\n", w);
+    fclose(w);
+    _exit(0);
+  }
+  close(fds[1]);
+  errnum = toml_unmarshal_fd(fds[0], template);
+  close(fds[0]);
+  waitpid(pid, &status, 0);
+  assert_signed_integer("errnum", 0, errnum);
+
+  assert_string("device", "/dev/spidev0.0", device);
+  assert_signed_integer("speed", 76213, (long) (speed * 1000 + 0.5));
+  assert_signed_integer("nvalues", N, nvalues);
+  for (int i = 0; i < nvalues; i++)
+    sum += values[i];
+  assert_signed_integer("sum", 7L * N * (N - 1) / 2, sum);
+}
+
+/* Loads the file, and others written next to it, three at a time,
+   through io_uring and then through threads. A file that does not
+   parse only fails itself. */
+void load_test(FILE *f) {
+  enum { N = 8 };
+  char dir[] = "/tmp/toml_load_XXXXXX", paths[N + 3][64], buf[3 * 128];
+  char device[2][16], names[N][16];
+  int counts[N], count[2];
+  const struct toml_key keyvalues[2][3] = {
+      {{"device", toml_string_t, .u.string = device[0],
+        .size = sizeof(device[0])},
+       {"count", toml_int_t, .u.integer.i = &count[0]},
+       {NULL}},
+      {{"device", toml_string_t, .u.string = device[1],
+        .size = sizeof(device[1])},
+       {"count", toml_int_t, .u.integer.i = &count[1]},
+       {NULL}}};
+#define KEYS(n)                                                         \
+  {{"name", toml_string_t, .u.string = names[n], .size = sizeof(names[n])}, \
+   {"count", toml_int_t, .u.integer.i = &counts[n]},                     \
+   {NULL}}
+  const struct toml_key keys[N][3] = {KEYS(0), KEYS(1), KEYS(2), KEYS(3),
+                                      KEYS(4), KEYS(5), KEYS(6), KEYS(7)};
+#undef KEYS
+  struct toml_file files[N + 4];
+  char doc[BUFSIZ];
+  size_t len;
+
+  len = fread(doc, 1, sizeof(doc), f);
+  /* the lines of the file other than device and count are not in the
+     templates: drop them */
+  len = strstr(doc, "flag") - doc;
+  if (mkdtemp(dir) == NULL) {
+    perror("mkdtemp");
+    exit(1);
+  }
+  for (int i = 0; i < N + 3; i++) {
+    FILE *w;
+
+    snprintf(paths[i], sizeof(paths[i]), "%s/%d.toml", dir, i);
+    w = fopen(paths[i], "w");
+    if (i < N)
+      fprintf(w, "name = \"file %d\"\ncount = %d\n", i, i * 10);
+    else if (i == N)
+      fwrite(doc, 1, len, w);
+    else if (i == N + 1)
+      fprintf(w, "name = \"%0200d\"\n", 0); /* too large for a slot */
+    else
+      fprintf(w, "name = \n");
+    fclose(w);
+  }
+
+  for (int pass = 0; pass < 2; pass++) {
+    if (pass == 1)
+      setenv("TOML_NO_URING", "1", 1);
+    memset(counts, 0, sizeof(counts));
+    for (int i = 0; i < N; i++)
+      files[i] = (struct toml_file){paths[i], keys[i]};
+    files[N] = (struct toml_file){paths[N], keyvalues[pass]};
+    files[N + 1] = (struct toml_file){paths[N + 1], keys[0]};
+    files[N + 2] = (struct toml_file){"/nonexistent.toml", keys[0]};
+    files[N + 3] = (struct toml_file){paths[N + 2], keys[0]};
+    assert_signed_integer("toml_load", -1,
+                          toml_load(files, N + 4, buf, sizeof(buf), 3));
+    for (int i = 0; i < N; i++) {
+      char name[16];
+
+      snprintf(name, sizeof(name), "file %d", i);
+      assert_string("name", name, names[i]);
+      assert_signed_integer("count", i * 10, counts[i]);
+      assert_signed_integer("error", 0, files[i].error);
+    }
+    assert_string("device", "/dev/spidev0.0", device[pass]);
+    assert_signed_integer("count", 4, count[pass]);
+    assert_signed_integer("too large", EFBIG, files[N + 1].error);
+    assert_signed_integer("missing", ENOENT, files[N + 2].error);
+    assert_signed_integer("invalid", EINVAL, files[N + 3].error);
+  }
+  unsetenv("TOML_NO_URING");
+
+  for (int i = 0; i < N + 3; i++)
+    unlink(paths[i]);
+  rmdir(dir);
+}
+
+/* Reloads the strings twice, and then a bad revision. */
+void reload_test(FILE *f) {
+  struct config {
+    char *strings1[3];
+    char strings1store[64];
+    int count1;
+    char *strings2[3];
+    char strings2store[64];
+    int count2;
+    char *strings3[3];
+    char strings3store[2];
+    int count3;
+  } config, shadow;
+  const struct toml_key template[] = {
+      {"strings1", toml_array_t,
+       toml_array_strings(config.strings1, config.strings1store,
+                          &config.count1)},
+      {"strings2", toml_array_t,
+       toml_array_strings(config.strings2, config.strings2store,
+                          &config.count2)},
+      {"strings3", toml_array_t,
+       toml_array_strings(config.strings3, config.strings3store,
+                          &config.count3)},
+      {NULL}};
+  struct toml_reload r = {template, toml_reload_storage(config, shadow)};
+  const struct config *c;
+  FILE *bad;
+  int errnum;
+
+  memset(&config, 0, sizeof(config));
+  for (int i = 0; i < 2; i++) {
+    rewind(f);
+    errnum = toml_reload(&r, f);
+    assert_signed_integer("errnum", 0, errnum);
+
+    c = toml_read_lock(&r);
+    assert_signed_integer("snapshot", (long) r.buf[!i], (long) c);
+    assert_signed_integer("count1", 3, c->count1);
+    assert_string("strings1[2]", "three", c->strings1[2]);
+    assert_signed_integer("strings1[2] in snapshot", 1,
+                          c->strings1[2] >= c->strings1store &&
+                              c->strings1[2] < c->strings1store + 64);
+    assert_string("strings2[2]", "thisisalongstring", c->strings2[2]);
+    toml_read_unlock(&r, c);
+  }
+
+  bad = tmpfile();
+  fputs("strings1 = [\"one\", 2]\n", bad);
+  rewind(bad);
+  errnum = toml_reload(&r, bad);
+  fclose(bad);
+  assert_signed_integer("errnum != 0", 1, errnum != 0);
+  c = toml_read_lock(&r);
+  assert_string("strings1[0]", "one", c->strings1[0]);
+  assert_signed_integer("count1", 3, c->count1);
+  toml_read_unlock(&r, c);
+}
+
+/* Tells whether p points into the snapshot c of size bytes. */
+static bool in_snapshot(const void *p, const void *c, size_t size) {
+  return (const char *) p >= (const char *) c &&
+         (const char *) p < (const char *) c + size;
+}
+
+/* Reloads a revision, and then one without the strings it stored: those
+   left from the first must point into the snapshot they are read from. */
+void reload_rebase_test(FILE *f) {
+  struct host {
+    struct toml_strview name;
+    int port;
+  };
+  struct config {
+    char *strings[2];
+    char stringsstore[16];
+    int nstrings;
+    struct toml_variant mixed[4];
+    char mixedstore[16];
+    int nmixed;
+    struct toml_strview view;
+    char viewstore[16];
+    char motd[16];
+    char *motdp;
+    struct host hosts[2];
+    char namestore[16];
+    int nhosts;
+  } config, shadow;
+  const struct toml_key hostkeys[] = {
+      {"name", toml_strview_t,
+       .u.strview = {(struct toml_strview *) offsetof(struct host, name),
+                     config.namestore},
+       .size = sizeof(config.namestore)},
+      {"port", toml_int_t, toml_table_field(struct host, port)},
+      {NULL}};
+  const struct toml_key template[] = {
+      {"strings", toml_array_t,
+       toml_array_strings(config.strings, config.stringsstore,
+                          &config.nstrings)},
+      {"mixed", toml_array_t,
+       toml_array_variants(config.mixed, config.mixedstore, &config.nmixed)},
+      {"view", toml_strview_t, .u.strview = {&config.view, config.viewstore},
+       .size = sizeof(config.viewstore)},
+      {"motd", toml_string_t, .u.string = config.motd,
+       .size = sizeof(config.motd), .data = (void **) &config.motdp},
+      {"hosts", toml_array_t,
+       toml_array_tables(config.hosts, hostkeys, &config.nhosts)},
+      {NULL}};
+  struct toml_reload r = {template, toml_reload_storage(config, shadow)};
+  const char *revisions[] = {"strings = [\"a\", \"b\"]\n"
+                             "mixed = [1, \"two\", [\"three\"]]\n"
+                             "view = \"seen\"\n"
+                             "motd = \"hello\"\n"
+                             "[[hosts]]\n"
+                             "name = \"alpha\"\n"
+                             "port = 1\n",
+                             "[[hosts]]\n"
+                             "port = 2\n"};
+  const struct config *c;
+
+  (void) f;
+  memset(&config, 0, sizeof(config));
+  for (int i = 0; i < 2; i++) {
+    FILE *rev = tmpfile();
+
+    fputs(revisions[i], rev);
+    rewind(rev);
+    assert_signed_integer("errnum", 0, toml_reload(&r, rev));
+    fclose(rev);
+  }
+
+  c = toml_read_lock(&r);
+  assert_signed_integer("nstrings", 2, c->nstrings);
+  assert_string("strings[1]", "b", c->strings[1]);
+  assert_boolean("strings[1] in snapshot", true,
+                 in_snapshot(c->strings[1], c, sizeof(*c)));
+  assert_signed_integer("nmixed", 4, c->nmixed);
+  assert_string("mixed[1]", "two", c->mixed[1].u.string);
+  assert_boolean("mixed[1] in snapshot", true,
+                 in_snapshot(c->mixed[1].u.string, c, sizeof(*c)));
+  assert_string("mixed[3]", "three", c->mixed[3].u.string);
+  assert_boolean("mixed[3] in snapshot", true,
+                 in_snapshot(c->mixed[3].u.string, c, sizeof(*c)));
+  assert_boolean("view in snapshot", true,
+                 in_snapshot(c->view.ptr, c, sizeof(*c)));
+  assert_signed_integer("view.len", 4, c->view.len);
+  assert_boolean("motd in snapshot", true,
+                 in_snapshot(c->motdp, c, sizeof(*c)));
+  assert_string("motd", "hello", c->motdp);
+  assert_signed_integer("nhosts", 1, c->nhosts);
+  assert_signed_integer("hosts[0].port", 2, c->hosts[0].port);
+  assert_boolean("hosts[0].name in snapshot", true,
+                 in_snapshot(c->hosts[0].name.ptr, c, sizeof(*c)));
+  toml_read_unlock(&r, c);
+}
+
+/* Watches a copy of the key/values, and rewrites it. */
+void watch_test(FILE *f) {
+  struct config {
+    char device[16];
+    int count;
+    bool flag;
+    double speed;
+  } config, shadow;
+  const struct toml_key template[] = {
+      {"device", toml_string_t, .u.string = config.device,
+       .size = sizeof(config.device)},
+      {"count", toml_int_t, .u.integer.i = &config.count},
+      {"flag", toml_bool_t, .u.boolean = &config.flag},
+      {"speed", toml_float_t, .u.real = &config.speed},
+      {NULL}};
+  struct toml_reload r = {template, toml_reload_storage(config, shadow)};
+  struct toml_watch w = {&r, .debounce = 10};
+  char dir[] = "/tmp/toml_testXXXXXX", path[64], buf[BUFSIZ];
+  const struct config *c;
+  size_t len;
+  FILE *out;
+
+  len = fread(buf, 1, sizeof(buf) - 1, f);
+  if (mkdtemp(dir) == NULL) {
+    perror("mkdtemp");
+    exit(EXIT_FAILURE);
+  }
+  snprintf(path, sizeof(path), "%s/config.toml", dir);
+  out = fopen(path, "w");
+  fwrite(buf, 1, len, out);
+  fclose(out);
+
+  assert_signed_integer("open", 0, toml_watch_open(&w, path));
+  assert_signed_integer("load", 1, toml_watch_load(&w));
+  c = toml_read_lock(&r);
+  assert_signed_integer("count", 4, c->count);
+  toml_read_unlock(&r, c);
+
+  /* the same contents are not parsed again */
+  out = fopen(path, "w");
+  fwrite(buf, 1, len, out);
+  fclose(out);
+  assert_signed_integer("rewrite", 0, toml_watch_wait(&w, 1000));
+
+  buf[len] = '\0';
+  strstr(buf, "count = 4")[8] = '5';
+  out = fopen(path, "w");
+  fwrite(buf, 1, len, out);
+  fclose(out);
+  assert_signed_integer("change", 1, toml_watch_wait(&w, 1000));
+  c = toml_read_lock(&r);
+  assert_signed_integer("count", 5, c->count);
+  assert_string("device", "/dev/spidev0.0", c->device);
+  toml_read_unlock(&r, c);
+
+  toml_watch_close(&w);
+  unlink(path);
+  rmdir(dir);
+}
+
+/* Parses the tables, and then a revision where only table-1 changed. */
+void incremental_test(FILE *f) {
+  char buf[BUFSIZ];
+  size_t len;
+  struct {
+    int freq;
+    unsigned short radio;
+    int if_freq;
+  } toml;
+  char type[8], device[16], type0[8];
+  bool lorawan_public, enable0, enable1;
+  int clksrc;
+  double rssi_offset;
+  const struct toml_key table0[] = {
+      {"enable", toml_bool_t, .u.boolean = &enable0},
+      {"type", toml_string_t, .u.string = type0, .size = sizeof(type0)},
+      {"freq", toml_int_t, .u.integer.i = &toml.freq},
+      {"rssi_offset", toml_float_t, .u.real = &rssi_offset},
+      {NULL}};
+  const struct toml_key table1[] = {
+      {"enable", toml_bool_t, .u.boolean = &enable1},
+      {"radio", toml_ushort_t, .u.integer.us = &toml.radio},
+      {"if", toml_int_t, .u.integer.i = &toml.if_freq},
+      {NULL}};
+  const struct toml_key root[] = {
+      {"type", toml_string_t, .u.string = type, .size = sizeof(type)},
+      {"device", toml_string_t, .u.string = device, .size = sizeof(device)},
+      {"clksrc", toml_int_t, .u.integer.i = &clksrc},
+      {"lorawan_public", toml_bool_t, .u.boolean = &lorawan_public},
+      {"table-0", toml_table_t, .u.table = table0},
+      {"table-1", toml_table_t, .u.table = table1},
+      {NULL}};
+  unsigned long long hashes[8];
+  struct toml_index idx = {hashes, toml_len(hashes)};
+  int errnum;
+
+  len = fread(buf, 1, sizeof(buf) - 1, f);
+  buf[len] = '\0';
+  errnum = toml_unmarshal_incremental(buf, len, root, &idx);
+  assert_signed_integer("errnum", 0, errnum);
+  assert_unsigned_integer("sections", 3, idx.count);
+  assert_signed_integer("table-0.freq", 917200000, toml.freq);
+  assert_unsigned_integer("table-1.radio", 0, toml.radio);
+
+  toml.freq = 0; /* must not be parsed again */
+  strstr(buf, "radio = 0")[8] = '1';
+  errnum = toml_unmarshal_incremental(buf, len, root, &idx);
+  assert_signed_integer("errnum", 0, errnum);
+  assert_signed_integer("table-0.freq", 0, toml.freq);
+  assert_unsigned_integer("table-1.radio", 1, toml.radio);
+  assert_signed_integer("table-1.if", -200000, toml.if_freq);
+}
+
+/* Parses a revision in another buffer, after the first was overwritten:
+   the views of the section not parsed again are in their store. */
+void incremental_views_test(FILE *f) {
+  static const char rev[] = "name = 'gateway'\n"
+                            "[radio]\n"
+                            "channel = 1\n";
+  char buf1[64], buf2[64], store[16];
+  struct toml_strview name;
+  int channel;
+  const struct toml_key radio[] = {
+      {"channel", toml_int_t, .u.integer.i = &channel}, {NULL}};
+  const struct toml_key root[] = {
+      {"name", toml_strview_t, .u.strview = {&name, store},
+       .size = sizeof(store)},
+      {"radio", toml_table_t, .u.table = radio},
+      {NULL}};
+  const struct toml_key unstored[] = {
+      {"name", toml_strview_t, .u.strview.view = &name},
+      {"radio", toml_table_t, .u.table = radio},
+      {NULL}};
+  unsigned long long hashes[4];
+  struct toml_index idx = {hashes, toml_len(hashes)};
+  size_t len = strlen(rev);
+
+  (void) f;
+  memcpy(buf1, rev, len);
+  assert_signed_integer("errnum", 0,
+                        toml_unmarshal_incremental(buf1, len, root, &idx));
+  assert_view("name", "gateway", name, store, sizeof(store), true);
+
+  memcpy(buf2, rev, len);
+  strstr(buf2, "channel = 1")[10] = '2';
+  memset(buf1, 'x', sizeof(buf1));
+  assert_signed_integer("errnum", 0,
+                        toml_unmarshal_incremental(buf2, len, root, &idx));
+  assert_signed_integer("radio.channel", 2, channel);
+  assert_view("name", "gateway", name, store, sizeof(store), true);
+
+  idx.count = 0;
+  errno = 0;
+  assert_signed_integer("unstored", -1,
+                        toml_unmarshal_incremental(buf2, len, unstored, &idx));
+  assert_signed_integer("errno", EINVAL, errno);
+}
+
+/* Publishes the strings, and reads them back from another process. */
+void shm_test(FILE *f) {
+  struct config {
+    char *strings1[3];
+    char strings1store[64];
+    int count1;
+    char *strings2[3];
+    char strings2store[64];
+    int count2;
+    char *strings3[3];
+    char strings3store[2];
+    int count3;
+  } config;
+  const struct toml_key template[] = {
+      {"strings1", toml_array_t,
+       toml_array_strings(config.strings1, config.strings1store,
+                          &config.count1)},
+      {"strings2", toml_array_t,
+       toml_array_strings(config.strings2, config.strings2store,
+                          &config.count2)},
+      {"strings3", toml_array_t,
+       toml_array_strings(config.strings3, config.strings3store,
+                          &config.count3)},
+      {NULL}};
+  struct toml_shm writer = {template, toml_shm_storage(config)};
+  char name[32];
+  int status;
+  pid_t pid;
+
+  snprintf(name, sizeof(name), "/toml_test.%d", (int) getpid());
+  assert_signed_integer("create", 0, toml_shm_create(&writer, name));
+  assert_signed_integer("publish", 0, toml_shm_publish(&writer, f));
+
+  fflush(stdout);
+  if ((pid = fork()) == 0) {
+    struct toml_shm reader = {template, toml_shm_storage(config)};
+    const struct config *c;
+    unsigned long gen;
+    char got[3][32];
+    int count;
+
+    assert_signed_integer("open", 0, toml_shm_open(&reader, name));
+    do {
+      gen = toml_shm_begin(&reader);
+      c = reader.image;
+      count = c->count2;
+      for (int i = 0; i < count && i < 3; i++)
+        snprintf(got[i], sizeof(got[i]), "%s",
+                 toml_shm_string(&reader, c->strings2[i]));
+    } while (toml_shm_retry(&reader, gen));
+    toml_shm_close(&reader);
+
+    assert_signed_integer("count2", 3, count);
+    assert_string("strings2[0]", "four", got[0]);
+    assert_string("strings2[2]", "thisisalongstring", got[2]);
+    exit(EXIT_SUCCESS);
+  }
+  waitpid(pid, &status, 0);
+  toml_shm_close(&writer);
+  shm_unlink(name);
+  assert_signed_integer("reader", 0, status);
+}
+
+/* Publishes the strings of variants, views and tables, which are read
+   as offsets, and rejects a template whose values may grow out of the
+   storage. */
+void shm_pointers_test(FILE *f) {
+  static struct arena arena;
+  const struct toml_allocator alloc = {arena_alloc, NULL, &arena};
+  struct host {
+    struct toml_strview name;
+    int port;
+  };
+  struct config {
+    struct toml_variant mixed[4];
+    char mixedstore[16];
+    int nmixed;
+    struct toml_strview view;
+    char viewstore[16];
+    char motd[16];
+    char *motdp;
+    struct host hosts[2];
+    char namestore[16];
+    int nhosts;
+  } config;
+  const struct toml_key hostkeys[] = {
+      {"name", toml_strview_t,
+       .u.strview = {(struct toml_strview *) offsetof(struct host, name),
+                     config.namestore},
+       .size = sizeof(config.namestore)},
+      {"port", toml_int_t, toml_table_field(struct host, port)},
+      {NULL}};
+  const struct toml_key template[] = {
+      {"mixed", toml_array_t,
+       toml_array_variants(config.mixed, config.mixedstore, &config.nmixed)},
+      {"view", toml_strview_t, .u.strview = {&config.view, config.viewstore},
+       .size = sizeof(config.viewstore)},
+      {"motd", toml_string_t, .u.string = config.motd,
+       .size = sizeof(config.motd), .data = (void **) &config.motdp},
+      {"hosts", toml_array_t,
+       toml_array_tables(config.hosts, hostkeys, &config.nhosts)},
+      {NULL}};
+  const struct toml_key growing[] = {
+      {"mixed", toml_array_t,
+       toml_array_variants(config.mixed, config.mixedstore, &config.nmixed),
+       .alloc = &alloc, .data = (void **) &config.motdp},
+      {NULL}};
+  struct toml_shm writer = {template, toml_shm_storage(config)};
+  const char *doc = "mixed = [1, \"two\", [\"three\"]]\n"
+                    "view = \"seen\"\n"
+                    "motd = \"hello\"\n"
+                    "[[hosts]]\n"
+                    "name = \"alpha\"\n"
+                    "port = 1\n";
+  FILE *in = fmemopen((void *) doc, strlen(doc), "r");
+  char name[32];
+  int status;
+  pid_t pid;
+
+  (void) f;
+  memset(&config, 0, sizeof(config));
+  snprintf(name, sizeof(name), "/toml_test.%d", (int) getpid());
+  assert_signed_integer("create", 0, toml_shm_create(&writer, name));
+  assert_signed_integer("publish", 0, toml_shm_publish(&writer, in));
+  fclose(in);
+
+  fflush(stdout);
+  if ((pid = fork()) == 0) {
+    struct toml_shm reader = {template, toml_shm_storage(config)};
+    const struct config *c;
+    unsigned long gen;
+    char got[5][32];
+
+    assert_signed_integer("open", 0, toml_shm_open(&reader, name));
+    do {
+      gen = toml_shm_begin(&reader);
+      c = reader.image;
+      snprintf(got[0], sizeof(got[0]), "%s",
+               toml_shm_string(&reader, c->mixed[1].u.string));
+      snprintf(got[1], sizeof(got[1]), "%s",
+               toml_shm_string(&reader, c->mixed[3].u.string));
+      snprintf(got[2], sizeof(got[2]), "%.*s", (int) c->view.len,
+               toml_shm_string(&reader, c->view.ptr));
+      snprintf(got[3], sizeof(got[3]), "%s",
+               toml_shm_string(&reader, c->motdp));
+      snprintf(got[4], sizeof(got[4]), "%.*s", (int) c->hosts[0].name.len,
+               toml_shm_string(&reader, c->hosts[0].name.ptr));
+    } while (toml_shm_retry(&reader, gen));
+    toml_shm_close(&reader);
+
+    assert_string("mixed[1]", "two", got[0]);
+    assert_string("mixed[3]", "three", got[1]);
+    assert_string("view", "seen", got[2]);
+    assert_string("motd", "hello", got[3]);
+    assert_string("hosts[0].name", "alpha", got[4]);
+    exit(EXIT_SUCCESS);
+  }
+  waitpid(pid, &status, 0);
+  assert_signed_integer("reader", 0, status);
+
+  writer.keys = growing;
+  errno = 0;
+  assert_signed_integer("publish growing", -1, toml_shm_publish(&writer, f));
+  assert_signed_integer("errno", EINVAL, errno);
+  toml_shm_close(&writer);
+  shm_unlink(name);
+}
+
 const struct test {
   char *name;
   void (*func)(FILE *);
 } tests[] = {{"integers", integers_test},
-             /* {"tables", test_tables}, */
+             {"strings", strings_test},
+             {"strings", long_strings_test},
+             {"strings", strview_test},
+             {"tables", tables_test},
+             {"tables", incremental_test},
+             {"tables", incremental_views_test},
              /* {"array_integers", test_array_integers}, */
              /* {"array_reals", test_array_reals}, */
              /* {"array_booleans", test_array_booleans}, */
-             /* {"array_strings", test_array_strings}, */
-             /* {"inline_tables", test_inline_tables}, */
-             /* {"array_inline_tables", test_array_inline_tables}, */
-             /* {"array_tables", test_array_tables}, */
-             /* {"array_tables_2", test_array_tables_2}, */
+             {"array_strings", array_strings_test},
+             {"array_strings", alloc_strings_test},
+             {"array_strings", reload_test},
+             {"array_strings", reload_rebase_test},
+             {"array_strings", shm_test},
+             {"array_strings", shm_pointers_test},
+             {"keyvalues", tape_test},
+             {"keyvalues", watch_test},
+             {"keyvalues", defaults_test},
+             {"keyvalues", stats_test},
+             {"keyvalues", trace_test},
+             {"keyvalues", fd_test},
+             {"keyvalues", load_test},
+             {"nested_arrays", nested_arrays_test},
+             {"numeric_arrays", numeric_arrays_test},
+             {"inline_tables", inline_tables_test},
+             {"array_inline_tables", array_inline_tables_test},
+             {"array_tables", array_tables_test},
+             {"array_tables_2", array_tables_2_test},
+             {"array_tables", parallel_test},
+             {"array_tables", feed_test},
+             {"json", json_test},
+             {"array_tables", required_test},
+             {"array_tables", required_tables_test},
+             {"array_tables", alloc_test},
              {NULL}};
 
 int main() {
@@ -0,0 +1,48 @@
+/* tomltrace - print the trace records that toml_trace_write wrote.
+ *
+ * Usage: tomltrace [file]
+ *
+ * Prints one record per line, the oldest first: its time in
+ * microseconds since the first, the event, the line and byte offset
+ * in the input, and the key.
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <stdio.h>
+
+#include "toml.h"
+
+static struct toml_trace_record records[1 << 16];
+
+int main(int argc, char *argv[]) {
+  struct toml_trace t = {toml_trace_storage(records)};
+  unsigned long first;
+  FILE *f = stdin;
+
+  if (argc > 2) {
+    fprintf(stderr, "usage: %s [file]\n", argv[0]);
+    return 2;
+  }
+  if (argc == 2 && (f = fopen(argv[1], "rb")) == NULL) {
+    perror(argv[1]);
+    return 1;
+  }
+  if (toml_trace_read(&t, f) != 0) {
+    fprintf(stderr, "%s: not a trace\n", argc == 2 ? argv[1] : "stdin");
+    return 1;
+  }
+  first = t.count > t.len ? t.count - t.len : 0;
+  for (unsigned long i = first; i < t.count; i++) {
+    const struct toml_trace_record *r = &t.records[i & (t.len - 1)];
+    const struct toml_trace_record *r0 = &t.records[first & (t.len - 1)];
+
+    printf("%12.3f %-12s %6u ", (r->time - r0->time) / 1000.0,
+           toml_event_name(r->event), r->lineno);
+    if (r->offset != ~0u)
+      printf("%8u", r->offset);
+    else
+      printf("%8s", "-");
+    printf(" %.*s\n", (int) sizeof(r->key), r->key);
+  }
+  return 0;
+}
@@ -0,0 +1,129 @@
+/* watch.c - reload a TOML file when it changes.
+ *
+ * The watcher uses inotify(7) on the directory of the file, so that
+ * files replaced by rename(2), as editors and deployment tools do, are
+ * seen as well as files written in place. Bursts of events are
+ * coalesced, and the file is parsed only if its contents hash
+ * differently from the last revision seen.
+ *
+ * Copyright (c) 2022, Francisco Oliveto <franciscoliveto@gmail.com>
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "toml.h"
+
+enum {
+  EVENTS = IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_MODIFY,
+};
+
+/* Returns the 64-bit FNV-1a hash of the contents of f. */
+static unsigned long long hash_file(FILE *f) {
+  unsigned long long h = 14695981039346656037ULL;
+  unsigned char buf[BUFSIZ];
+  size_t n;
+
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+    for (size_t i = 0; i < n; i++) {
+      h ^= buf[i];
+      h *= 1099511628211ULL;
+    }
+  }
+  return h;
+}
+
+/* Reads the pending events, and returns whether any was about the
+   watched file. */
+static bool drain(struct toml_watch *w) {
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  bool match = false;
+  ssize_t n;
+
+  while ((n = read(w->fd, buf, sizeof(buf))) > 0) {
+    for (char *p = buf; p < buf + n;) {
+      const struct inotify_event *ev = (const struct inotify_event *) p;
+
+      if (ev->len > 0 && strcmp(ev->name, w->name) == 0)
+        match = true;
+      p += sizeof(*ev) + ev->len;
+    }
+  }
+  return match;
+}
+
+int toml_watch_open(struct toml_watch *w, const char *path) {
+  const char *slash = strrchr(path, '/');
+  char dir[PATH_MAX];
+
+  if (slash == NULL)
+    strcpy(dir, ".");
+  else if (slash == path)
+    strcpy(dir, "/");
+  else
+    snprintf(dir, sizeof(dir), "%.*s", (int) (slash - path), path);
+  if (strlen(slash ? slash + 1 : path) >= sizeof(w->name)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(w->name, slash ? slash + 1 : path);
+  w->path = path;
+  w->hash = 0;
+  w->loaded = false;
+  if (w->debounce <= 0)
+    w->debounce = 50;
+  if ((w->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1)
+    return -1;
+  if (inotify_add_watch(w->fd, dir, EVENTS) == -1) {
+    close(w->fd);
+    return -1;
+  }
+  return 0;
+}
+
+int toml_watch_load(struct toml_watch *w) {
+  unsigned long long h;
+  FILE *f;
+  int errnum;
+
+  if ((f = fopen(w->path, "r")) == NULL)
+    return -1;
+  h = hash_file(f);
+  if (w->loaded && h == w->hash) { /* rewritten with the same contents */
+    fclose(f);
+    return 0;
+  }
+  /* A revision that does not parse is remembered too, so that it is
+     not parsed again until it changes. */
+  w->hash = h;
+  w->loaded = true;
+  rewind(f);
+  errnum = toml_reload(w->reload, f);
+  fclose(f);
+  return errnum == 0 ? 1 : -1;
+}
+
+int toml_watch_wait(struct toml_watch *w, int timeout) {
+  struct pollfd pfd = {.fd = w->fd, .events = POLLIN};
+  bool match = false;
+  int n;
+
+  if ((n = poll(&pfd, 1, timeout)) <= 0)
+    return n;
+  /* Wait for the writes to settle before looking at the file. */
+  do
+    match |= drain(w);
+  while ((n = poll(&pfd, 1, w->debounce)) > 0);
+  if (n == -1)
+    return -1;
+  return match ? toml_watch_load(w) : 0;
+}
+
+void toml_watch_close(struct toml_watch *w) {
+  close(w->fd);
+}